@@ -2,7 +2,15 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// Buffers passed to read_write_sectors have to be reachable by the controller,
+// which might only support 32-bit addresses
 void read_write_sectors(uint8_t device_id, uint64_t sector, uint16_t sector_count, void* buffer,
                         bool write);
 
+// Allocates a physically contiguos buffer for sector_count sectors
+// which is reachable by the controller
+void* alloc_sector_buffer(uint16_t sector_count);
+
+void free_sector_buffer(void* buffer, uint16_t sector_count);
+
 void initialize_ahci();
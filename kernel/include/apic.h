@@ -13,6 +13,9 @@
 // 8259 + slave has 16(-1) IRQ lines
 #define MAX_8259_IRQ_COUNT 16
 
+// Maximum number of processors (Local APICs) supported
+#define MAX_LAPIC_COUNT 16
+
 // MADT Structs
 typedef struct {
     uint8_t ioapic_id;
@@ -125,6 +128,9 @@ extern GSIOverrideEntry g_gsi_override_table[MAX_8259_IRQ_COUNT];
 // Finds, pages and prepares LAPICs and IOAPICs
 void setup_apic();
 
+// Gets the index of the processor executing the call, in the range [0, MAX_LAPIC_COUNT)
+uint32_t get_cpu_index();
+
 // Gets the Local APIC id from a ACPI processor id
 bool get_lapic_id(uint8_t acpi_id, uint8_t* lapic_id);
 
@@ -6,13 +6,22 @@
 // Allocates physically non contiguos pages which are mapped with flags applied
 void* alloc_pages(uint64_t pages, PagingFlags paging_flags);
 
-// Frees pages allocated by alloc_pages
+// Allocates pages like alloc_pages for memory which is given back when no longer in use,
+// which keeps it grouped apart from memory that is never freed
+void* alloc_reclaimable_pages(uint64_t pages, PagingFlags paging_flags);
+
+// Frees pages allocated by alloc_pages or alloc_reclaimable_pages
 void free_pages(void* ptr, uint64_t pages);
 
 // Allocates physically contiguos pages which are mapped with flags applied
 void* alloc_pages_contiguous(uint64_t pages, PagingFlags paging_flags);
 
-// Frees pages allocated by alloc_pages_contiguos
+// Allocates physically contiguos pages which end at or below max_addr and start at a multiple
+// of align, mapped with flags applied (for devices with addressing limits)
+void* alloc_pages_constrained(uint64_t pages, PhysicalAddress max_addr, uint64_t align,
+                              PagingFlags paging_flags);
+
+// Frees pages allocated by alloc_pages_contiguos or alloc_pages_constrained
 void free_pages_contiguous(void* ptr, uint64_t pages);
 
 void initialize_memory(void* uefi_memory_map, PhysicalAddress* kernel_phys_addr,
@@ -0,0 +1,40 @@
+#pragma once
+#include <stdint.h>
+
+// Node of an AVL tree of page ranges ordered by address, the ranges of a tree never overlap.
+// Entries kept in such a tree start with a node, what they track about their subtree
+// is recalculated by the update callback of the tree whenever the subtree changes
+typedef struct {
+    void* left; // AddressNode
+    void* right;
+    uint64_t addr : 36; // Page number of the first page
+    uint64_t pages : 38;
+    uint8_t height;
+} __attribute__((packed)) AddressNode;
+
+// Recalculates what a node keeps about its subtree from its children, 0 if there is nothing
+typedef void (*AddressNodeUpdate)(AddressNode* node);
+
+// Inserts a node into the tree, returns the new root
+AddressNode* insert_address_node(AddressNode* root, AddressNode* node, AddressNodeUpdate update);
+
+// Takes the node starting at page addr out of the tree, returns the new root
+AddressNode* remove_address_node(AddressNode* root, uint64_t addr, AddressNodeUpdate update);
+
+// Updates the nodes on the path to the node starting at page addr after its size changed
+void update_address_node_path(AddressNode* root, uint64_t addr, AddressNodeUpdate update);
+
+// Finds the node containing page addr
+AddressNode* find_containing_address_node(AddressNode* root, uint64_t addr);
+
+// Finds the node with the highest address below page addr
+AddressNode* find_address_node_below(AddressNode* root, uint64_t addr);
+
+// Finds the node with the lowest address at or above page addr
+AddressNode* find_address_node_above(AddressNode* root, uint64_t addr);
+
+// Gives every node of the tree back to the entry pool they were taken from
+void free_address_tree(AddressNode* root, uint8_t pool);
+
+// Copies the tree into entries of size bytes taken from pool, returns the root of the copy
+AddressNode* copy_address_tree(const AddressNode* root, uint8_t pool, uint64_t size);
@@ -1,12 +1,35 @@
 #pragma once
 #include "memory.h"
 
+// Entries handed out by the pools are a multiple of this size
+#define ENTRY_SIZE 16
+
+// Pools of bookkeeping entries for the memory management code, one pool per entry type
+#define ENTRY_POOL_FRAME_ALLOCATIONS 0 // PageFrameAllocation, 16 bytes
+#define ENTRY_POOL_FREE_RANGES 1       // FreeRange, 32 bytes
+#define ENTRY_POOL_MEMORY_AREAS 2      // MemoryArea, 32 bytes
+#define ENTRY_POOL_COUNT 3
+
 typedef struct {
-    void* next;
-    uint64_t payload;
-} MemoryEntry;
+    // Number of entries handed out and given back since boot
+    uint64_t allocations;
+    uint64_t frees;
+
+    uint64_t entries_in_use;
+    uint64_t cached_entries; // Free entries in the processor local caches
+    uint64_t free_entries;   // Free entries in the pool pages
+    uint64_t pages;          // Pages owned by the pool
+} EntryPoolStats;
 
+// Gives memory to the pools which is never returned to the frame allocator,
+// used for the entries needed before the frame allocator is initialized
 void fill_memory_entry_pool(VirtualAddress addr, uint64_t pages);
 
-MemoryEntry* get_memory_entry();
-void free_memory_entry(MemoryEntry* entry);
+// Takes a cleared entry from the pool, pools grow a page at a time when they run low
+void* alloc_pool_entry(uint8_t pool);
+
+// Gives an entry back to the pool it was taken from,
+// pages where every entry is free are returned to the frame allocator
+void free_pool_entry(uint8_t pool, void* entry);
+
+void get_entry_pool_stats(uint8_t pool, EntryPoolStats* out_stats);
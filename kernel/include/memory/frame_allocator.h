@@ -3,7 +3,51 @@
 
 #include <stdbool.h>
 
-#define FRAME_ORDERS 8
+// Number of block sizes, the largest block is PAGE_SIZE << (FRAME_ORDERS - 1)
+// Configured through CMake, 10 gives 2MiB blocks and 19 gives 1GiB blocks
+#ifndef FRAME_ORDERS
+#    define FRAME_ORDERS 19
+#endif
+
+_Static_assert(FRAME_ORDERS >= 2 && FRAME_ORDERS <= 19,
+               "FRAME_ORDERS has to give a largest block between 8KiB and 1GiB");
+
+// Flags for alloc_frames
+// Prefer physically adjacent blocks, allocating as few physical runs as possible
+#define FRAME_CONTIGUOUS 1
+// Frames are cleared, frames zeroed ahead of time are used when possible
+#define FRAME_ZEROED 2
+// Frames can be moved by compaction (user pages), kept apart from kernel memory
+#define FRAME_MOVABLE 4
+// Frames are given back when no longer in use (slab caches)
+#define FRAME_RECLAIMABLE 8
+
+typedef uint32_t FrameFlags;
+
+// NUMA policies for frame allocations
+// Allocate from the policy node, falling back to the other nodes ordered by distance
+#define FRAME_POLICY_PREFERRED 0
+// Only allocate from the policy node
+#define FRAME_POLICY_BIND 1
+
+typedef struct {
+    uint64_t timestamp; // Time stamp counter when the stats were taken
+
+    uint64_t free_blocks[FRAME_ORDERS]; // Free blocks of every order in the free lists
+    uint64_t free_pages;                // Pages in the free lists
+    uint64_t cached_pages;              // Pages in the processor local frame caches
+    uint64_t zeroed_pages;              // Pages in the zeroed frame pools
+    uint64_t dma_region_free_pages;     // Free pages in the reserved DMA region
+    uint64_t deferred_pages;            // Pages which haven't been put in the free lists yet
+
+    // Number of calls to the allocation and free functions since boot
+    uint64_t allocations;
+    uint64_t frees;
+
+    // Number of times blocks have been split and merged since boot
+    uint64_t splits;
+    uint64_t merges;
+} FrameAllocatorStats;
 
 typedef struct {
     void* next;
@@ -19,6 +63,28 @@ void alloc_frame_allocator_memory(void* uefi_memory_map, PhysicalAddress* phys_a
 void initialize_frame_allocator(VirtualAddress virt_addr, uint64_t total_pages,
                                 void* uefi_memory_map, uint64_t entry_pool_pages);
 
+// Moves free memory to the free lists of the NUMA node it belongs to
+// Called once the NUMA topology has been read
+void assign_frame_numa_nodes();
+
+// Sets the NUMA policy used for frame allocations on the executing processor
+// Defaults to preferring the node of the processor
+void set_frame_policy(uint8_t mode, uint8_t node);
+
+// Returns the number of time stamp counter cycles initialize_frame_allocator took
+uint64_t get_frame_allocator_init_cycles();
+
+// Returns the number of bytes used by the frame allocator for its own bookkeeping
+uint64_t get_frame_allocator_metadata_size();
+
+// Takes a snapshot of the frame allocator statistics
+void get_frame_allocator_stats(FrameAllocatorStats* out_stats);
+
+// Returns the fragmentation index (at most 1000) for allocations of order,
+// or -1000 if an allocation of order would succeed
+// Values at or below 0 mean allocations fail from lack of memory, towards 1000 from fragmentation
+int32_t get_fragmentation_index(uint8_t order);
+
 // Get the size of the specified frame order
 uint64_t get_frame_order_size(uint8_t order);
 
@@ -29,19 +95,94 @@ uint8_t get_min_size_frame_order(uint64_t pages);
 // Returns size of allocation list in pages
 uint64_t calculate_allocation_pages(PageFrameAllocation* allocation);
 
+// Gets the size in pages of the physical run starting at the first block of allocation list
+// Returns the first block after the run
+PageFrameAllocation* get_allocation_run(PageFrameAllocation* allocation, uint64_t* out_pages);
+
+// Returns the number of physically contiguos runs in allocation list
+uint64_t calculate_allocation_runs(PageFrameAllocation* allocation);
+
 // Frees frame allocation list
 void free_frame_allocation_entries(PageFrameAllocation* allocations);
 
 // Allocate page frames (allocation may consist of several non-contiguos blocks)
+// With FRAME_CONTIGUOUS the blocks are picked to form as few physical runs as possible,
+// adjacent blocks in the list which are physically adjacent form a run
+// Frames are unmovable unless FRAME_MOVABLE or FRAME_RECLAIMABLE is passed
 // Underlying memory for PageFrameAllocation structs is owned by the allocator
-PageFrameAllocation* alloc_frames(uint64_t pages);
+PageFrameAllocation* alloc_frames(uint64_t pages, FrameFlags flags);
 
 // Frees allocation
 // Underlying memory for PageFrameAllocation structs will be reclaimed by the allocator
 void free_frames(PageFrameAllocation* allocation);
 
-// Allocate a block of contiguos memory (useful for DMA)
+// Frees a range of allocated frames, the range doesn't have to be a single allocation
+// as long as every frame in it is allocated
+void free_frame_range(PhysicalAddress addr, uint64_t pages);
+
+// Allocate a single page frame from the processor local frame cache
+bool alloc_frame(PhysicalAddress* out_addr);
+
+// Free a single page frame to the processor local frame cache
+// Cold frames (frames which aren't in the processor caches) are reused after hot frames
+void free_frame(PhysicalAddress addr, bool cold);
+
+// Allocate a single cleared page frame, from the zeroed frame pool when possible
+bool alloc_zeroed_frame(PhysicalAddress* out_addr);
+
+// Clears one free frame and puts it in the zeroed frame pool of the migrate type which is
+// furthest below its target, meant to be called when idle
+// Returns false if the pool is full or there is no free memory
+bool refill_zeroed_frames();
+
+// Puts a part of the memory left out at initialization in the free lists, meant to be called
+// when idle. Only the first part of memory is populated at boot so that boot time doesn't
+// depend on the amount of memory, allocations populate more memory if they run out.
+// Returns false if all memory has been populated
+bool populate_deferred_memory();
+
+// Returns all frames in the processor local frame cache to the free lists
+void drain_frame_caches();
+
+// Allocate exactly pages of contiguos memory (useful for DMA)
+// Requests the buddy allocator can't serve are taken from a reserved DMA region
 bool alloc_frames_contiguos(uint64_t pages, PhysicalAddress* out_addr);
 
-// Free block of contiguos memory
+// Allocate exactly pages of contiguos memory which ends at or below max_addr
+// and starts at a multiple of align (a power of two of at least PAGE_SIZE)
+bool alloc_frames_constrained(uint64_t pages, PhysicalAddress max_addr, uint64_t align,
+                              PhysicalAddress* out_addr);
+
+// Free contiguos memory allocated by alloc_frames_contiguos or alloc_frames_constrained,
+// pages has to be the same as when it was allocated
 void free_frames_contiguos(PhysicalAddress addr, uint64_t pages);
+
+// Frames mapped by several address spaces, like after a fork, count their owners.
+// Frames which aren't shared have one owner, shared frames are never moved by compaction
+void add_frame_owner(PhysicalAddress addr);
+
+// Returns the number of owners left
+uint32_t remove_frame_owner(PhysicalAddress addr);
+
+uint32_t get_frame_owners(PhysicalAddress addr);
+
+// Page tables count their present entries in the descriptor of their frame,
+// which is never shared or free while it's a table
+void set_frame_table_entries(PhysicalAddress addr, uint32_t count);
+
+// Returns the number of present entries after adding count
+uint32_t add_frame_table_entries(PhysicalAddress addr, int32_t count);
+
+// Compaction moves mapped frames out of a block to turn it into one free block.
+// The user marks the frames it is able to move, frames outside movable pageblocks are ignored.
+void mark_compaction_frame(PhysicalAddress addr);
+void unmark_compaction_frame(PhysicalAddress addr);
+
+// Finds the block of order where every frame is either free or marked, with the fewest marked
+// frames, and takes its free frames out of the free lists
+// Returns false if there is no such block or a free block of order already exists
+bool isolate_compaction_block(uint8_t order, PhysicalAddress* out_addr, uint64_t* out_marked);
+
+// Gives back an isolated block once its marked frames have been moved, if migrated is false
+// the marked frames are still in use and only the frames which were free are given back
+void release_compaction_block(PhysicalAddress addr, uint8_t order, bool migrated);
@@ -1,4 +1,5 @@
 #pragma once
+#include "memory/address_tree.h"
 #include "memory/defs.h"
 #include "memory/frame_allocator.h"
 
@@ -9,6 +10,13 @@
 
 #define SIGN_EXT_ADDR(addr) ((addr) | (((((addr) >> 47) & 1) * 0xffffULL) << 48))
 
+// All physical memory is mapped at DIRECT_MAP_OFFSET in every address space,
+// the kernel reaches page tables and other memory it doesn't keep mapped through it
+#define DIRECT_MAP_OFFSET 0xffffe00000000000ULL
+
+#define PHYS_TO_DIRECT_MAP(addr) ((VirtualAddress)(addr) + DIRECT_MAP_OFFSET)
+#define DIRECT_MAP_TO_PHYS(addr) ((PhysicalAddress)(addr) - DIRECT_MAP_OFFSET)
+
 typedef uint32_t PagingFlags;
 
 typedef union {
@@ -22,7 +30,9 @@ typedef union {
         bool dirty : 1;
         bool large : 1;
         bool global : 1;
-        uint8_t ignored0 : 3;
+        bool owned : 1;         // Frames owned by the address space, forks share them
+        bool copy_on_write : 1; // Shared writable page, made writable by copying on a write fault
+        uint8_t ignored0 : 1;
         PhysicalAddress phys_addr : 40;
         uint8_t ignored1 : 7;
         uint8_t prot : 4;
@@ -31,43 +41,67 @@ typedef union {
     uint64_t value;
 } PageEntry;
 
+// Unused address space below current_address, kept in an AVL tree ordered by address.
+// Every node knows the biggest range in its subtree so the lowest range which fits is found
+// in O(log n). Neighbouring ranges are always merged
 typedef struct {
-    VirtualAddress next : 48;
-    VirtualAddress addr : 36;
-    uint64_t pages : 44;
-} __attribute__((packed)) FreeListEntry;
+    AddressNode node;
+    uint64_t max_pages : 38; // Pages of the biggest range in the subtree
+} __attribute__((packed)) FreeRange;
+
+// What the pages of a memory area are backed by
+#define AREA_ZEROED 0 // Cleared frames allocated and mapped the first time a page is touched
+#define AREA_FRAMES 1 // Frames allocated and mapped together with the area
+#define AREA_PHYS 2   // Physical memory the area doesn't own, like the framebuffer
 
+// Address space in use by a user address space, kept in an AVL tree ordered by address.
+// Every mapping and reservation gets an area, areas never overlap
 typedef struct {
-    VirtualAddress next : 48;
-    VirtualAddress virt_addr : 36;
-    PhysicalAddress phys_addr : 38;
-} __attribute__((packed)) MappingEntry;
+    AddressNode node;
+    PagingFlags flags : 32; // Flags the pages are mapped with
+    uint8_t backing : 6;
+} __attribute__((packed)) MemoryArea;
 
 typedef struct {
+    // Address space from current_address to end_address has never been used
     VirtualAddress current_address;
+    VirtualAddress end_address;
 
-    uint16_t pdp_index;
-    PageEntry* pdp;
+    // User address spaces have their own PML4 which shares the kernel half of the kernel PML4
+    PageEntry* pml4;
 
     uint8_t prot : 4;
 
-    FreeListEntry* free_list;
+    FreeRange* free_ranges;
+
+    // Only user address spaces keep areas,
+    // the entry pools map the pages the areas are taken from in the kernel address space
+    MemoryArea* areas;
+
+    // TLB entries of the address space are tagged with its PCID when the CPU supports it
+    uint16_t pcid;
 
-    // Holds physical to virtual mapping of page table entries
-    MappingEntry* entry_maps[2];
+    // Set when entries are changed or removed while the address space isn't mapped,
+    // the TLB entries of the PCID are then flushed the next time it's mapped
+    bool tlb_stale;
+
+    // Kernel TLB generation when the TLB entries of the PCID were last known to be current
+    uint64_t kernel_tlb_generation;
 } AddressSpace;
 
-// Fills in the AddressSpace struct, checks for sane values and allocates memory for PDP
-void new_address_space(AddressSpace* space, uint16_t pdp_index, uint8_t prot);
+// Fills in the AddressSpace struct, checks for sane values and allocates memory for PML4
+// The address space covers the lower half of virtual memory
+void new_address_space(AddressSpace* space, uint8_t prot);
 
-// Frees page entries, lists and PDP
+// Frees page entries, lists and PML4
 void delete_address_space(AddressSpace* space);
 
-// Maps address space
+// Switches to the PML4 and PCID of the address space, keeping the TLB entries cached for it
+// Without PCID support the TLB is flushed instead
 void map_address_space(AddressSpace* space);
 
-// Unmaps address space
-void unmap_address_space(AddressSpace* space);
+// Memory is mapped with 2MiB or 1GiB large pages wherever the physical and virtual addresses
+// are aligned to them, map_allocation and map_phys_range pick virtual addresses which allow it
 
 // Maps discrete allocations into contiguos virtual address space
 VirtualAddress map_allocation(AddressSpace* space, PageFrameAllocation* allocation,
@@ -87,27 +121,62 @@ bool map_allocation_to_range(AddressSpace* space, PageFrameAllocation* allocatio
 bool map_to_range(AddressSpace* space, PhysicalAddress phys_addr, VirtualAddress virt_addr,
                   uint64_t pages, PagingFlags flags);
 
+// Large pages which a range only covers part of are split before they are unmapped or changed
+
 // Unmaps virtual address range
 void unmap_range(AddressSpace* space, VirtualAddress virt_addr, uint64_t pages);
 
-// Unmaps virtual address range and frees previously mapped frames
+// Unmaps virtual address range and frees the frames owned by the mappings
+// Frames shared with another address space are only freed by the last one to unmap them
 void unmap_and_free_frames(AddressSpace* space, VirtualAddress virt_addr, uint64_t pages);
 
+// Reserves address space for pages which are backed by cleared memory on first touch
+// Returns the address of the reserved range
+VirtualAddress reserve_area(AddressSpace* space, uint64_t pages, PagingFlags flags);
+
+// Maps memory for a fault on a page which isn't present in the mapped user address space.
+// Pages next to the faulting page are mapped with it so sequential access faults less often.
+// Write faults on copy on write pages give the address space its own copy of the page.
+// user is set for faults in user mode, the kernel faults on user memory it accesses for a process
+// Returns false if the address isn't in the user half or inside an area,
+// or if the access isn't allowed
+bool handle_page_fault(VirtualAddress virt_addr, bool present, bool write, bool user);
+
+// Writes to memory of an address space which doesn't have to be mapped, through the direct map.
+// Pages are faulted in and copied on write as if the address space wrote to them itself
+// Returns false if part of the range isn't mapped or in an area
+bool write_to_address_space(AddressSpace* space, VirtualAddress virt_addr, const void* data,
+                            uint64_t size);
+
+// Creates a copy of the parent address space which shares its frames until either one writes
+// to them, copying takes time proportional to the page tables of the parent.
+// The memory area containing stack_addr, the stack the kernel runs on, is copied up front
+void fork_address_space(AddressSpace* space, AddressSpace* parent, VirtualAddress stack_addr);
+
 // Translates a virtual address into the corresponding physical address
 // Returns false if the virtual address isn't mapped
 bool virt_to_phys_addr(AddressSpace* space, VirtualAddress virt_addr, PhysicalAddress* phys_addr);
 
-// Sets the flags for a virtual address range
+// Sets the flags for a virtual address range, pages of areas which aren't touched yet
+// are mapped with the new flags
 // Returns false if range is not mapped
 bool range_set_flags(AddressSpace* space, VirtualAddress virt_addr, uint64_t pages,
                      PagingFlags flags);
 
+// Moves pages of the address space out of the block of order which needs the fewest pages moved,
+// turning it into one free block. Only frames allocated with FRAME_MOVABLE are moved.
+// Returns the number of pages moved, 0 if no block could be freed
+uint64_t compact_address_space(AddressSpace* space, uint8_t order);
+
 VirtualAddress kmap_allocation(PageFrameAllocation* allocation, PagingFlags flags);
 
 VirtualAddress kmap_phys_range(PhysicalAddress phys_addr, uint64_t pages, PagingFlags flags);
 
 void kunmap_range(VirtualAddress virt_addr, uint64_t pages);
 
+// Clears physical memory by temporarily mapping it
+void kzero_phys_range(PhysicalAddress phys_addr, uint64_t pages);
+
 void kunmap_and_free_frames(VirtualAddress virt_addr, uint64_t pages);
 
 bool kvirt_to_phys_addr(VirtualAddress virt_addr, PhysicalAddress* phys_addr);
@@ -0,0 +1,43 @@
+// https://wiki.osdev.org/SRAT
+// ACPI specification 5.2.16 (SRAT) and 5.2.17 (SLIT)
+
+#pragma once
+#include "memory.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Maximum number of NUMA nodes (proximity domains) supported,
+// further domains are folded into the nearest node
+#define MAX_NUMA_NODES 8
+
+// Maximum number of memory ranges read from the SRAT,
+// further ranges are merged into the last one when they continue it and ignored otherwise
+#define MAX_NUMA_MEMORY_RANGES 32
+
+// Distance from a node to itself, remote distances are relative to this
+#define NUMA_LOCAL_DISTANCE 10
+
+// Distance used between different nodes when there is no SLIT
+#define NUMA_REMOTE_DISTANCE 20
+
+typedef struct {
+    PhysicalAddress base;
+    uint64_t size;
+    uint8_t node;
+} NUMAMemoryRange;
+
+// Reads the NUMA topology from the SRAT and SLIT and moves free memory to the node it belongs to
+// Machines without a SRAT are treated as a single node
+void initialize_numa();
+
+uint8_t get_numa_node_count();
+
+uint64_t get_numa_memory_range_count();
+const NUMAMemoryRange* get_numa_memory_range(uint64_t index);
+
+// Gets the relative distance between two nodes
+uint8_t get_numa_distance(uint8_t from, uint8_t to);
+
+// Gets the node of the processor executing the call
+uint8_t get_cpu_numa_node();
@@ -10,4 +10,9 @@ uint64_t get_current_process_pid();
 // NOTE: This function should only be called when at least one process is already running
 void start_user_process(const void* elf_data);
 
+// Starts a copy of the running process which continues from the fork syscall it's called from,
+// regs points to the callee saved registers followed by what the syscall dispatcher saved.
+// Returns the pid of the new process
+uint64_t fork_current_process(const uint64_t* regs);
+
 void initialize_process_system();
@@ -17,5 +17,8 @@
 // bool syscall_get_keystate(uint8_t keycode)
 #define SYSCALL_GET_KEYSTATE 4
 
+// uint64_t syscall_fork(), returns the pid of the new process and 0 in the new process
+#define SYSCALL_FORK 5
+
 // Enables syscalls and fills syscall table
 void prepare_syscalls();
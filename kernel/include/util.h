@@ -26,3 +26,6 @@ bool range_contains(uint64_t x, uint64_t lower, uint64_t size);
 
 // Checks whether or not the value x is within the range [lower, upper)
 bool bound_contains(uint64_t x, uint64_t lower, uint64_t upper);
+
+// Returns the current value of the processor time stamp counter
+uint64_t read_timestamp_counter();
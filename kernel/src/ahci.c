@@ -30,6 +30,9 @@ struct {
 
     Device* devices;
     uint8_t device_count;
+
+    // Highest physical address the controller can reach with DMA
+    PhysicalAddress dma_max_addr;
 } g_ahci = {0};
 
 void start_cmd(AHCIPort* port) {
@@ -92,6 +95,8 @@ void read_write_sectors(uint8_t device_id, uint64_t sector, uint16_t sector_coun
             PhysicalAddress phys_addr;
             const bool success = kvirt_to_phys_addr((VirtualAddress)buffer, &phys_addr);
             KERNEL_ASSERT(success, "Failed to get phys addr")
+            KERNEL_ASSERT(phys_addr + 0x2000 - 1 <= g_ahci.dma_max_addr,
+                          "Buffer not reachable by AHCI controller")
             cmd_table->prdt_entry[i].data_base = phys_addr;
 
             cmd_table->prdt_entry[i].byte_count = 0x2000 - 1;
@@ -102,6 +107,8 @@ void read_write_sectors(uint8_t device_id, uint64_t sector, uint16_t sector_coun
         PhysicalAddress phys_addr;
         const bool success = kvirt_to_phys_addr((VirtualAddress)buffer, &phys_addr);
         KERNEL_ASSERT(success, "Failed to get phys addr")
+        KERNEL_ASSERT(phys_addr + ((sector_count % 16) * 512) - 1 <= g_ahci.dma_max_addr,
+                      "Buffer not reachable by AHCI controller")
         cmd_table->prdt_entry[i].data_base = phys_addr;
 
         cmd_table->prdt_entry[i].byte_count = ((sector_count % 16) * 512) - 1;
@@ -145,6 +152,15 @@ void read_write_sectors(uint8_t device_id, uint64_t sector, uint16_t sector_coun
     }
 }
 
+void* alloc_sector_buffer(uint16_t sector_count) {
+    const uint64_t pages = ((uint64_t)sector_count * 512 + PAGE_SIZE - 1) / PAGE_SIZE;
+    return alloc_pages_constrained(pages, g_ahci.dma_max_addr, PAGE_SIZE, PAGING_WRITABLE);
+}
+
+void free_sector_buffer(void* buffer, uint16_t sector_count) {
+    free_pages_contiguous(buffer, ((uint64_t)sector_count * 512 + PAGE_SIZE - 1) / PAGE_SIZE);
+}
+
 void initialize_ahci() {
     // Setup PCI config space
     {
@@ -171,8 +187,9 @@ void initialize_ahci() {
         g_ahci.controller = (AHCIController*)kmap_phys_range(
             controller_phys_addr, abar_pages, PAGING_WRITABLE | PAGING_CACHE_DISABLE);
 
-        KERNEL_ASSERT(g_ahci.controller->capabilities & (1 << 31),
-                      "AHCI controller does not support 64-bit addressing")
+        // Controllers without 64-bit addressing need all DMA memory below 4GiB
+        g_ahci.dma_max_addr =
+            (g_ahci.controller->capabilities & (1 << 31)) != 0 ? UINT64_MAX : UINT32_MAX;
     }
 
     g_ahci.port_count = (g_ahci.controller->capabilities & 0x1f) + 1;
@@ -210,7 +227,7 @@ void initialize_ahci() {
             const uint64_t size = cmd_headers_size + fis_size + cmd_tables_size;
             const uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
 
-            alloc_pages_contiguous(pages, PAGING_WRITABLE);
+            alloc_pages_constrained(pages, g_ahci.dma_max_addr, PAGE_SIZE, PAGING_WRITABLE);
         });
         KERNEL_ASSERT(dma_ptr, "Failed to allocate memory")
 
@@ -6,7 +6,6 @@
 #include "kassert.h"
 
 #define MAX_IOAPIC_COUNT 4
-#define MAX_LAPIC_COUNT 16
 
 #define LOCAL_APIC_ENTRY 0
 #define IO_APIC_ENTRY 1
@@ -233,6 +232,13 @@ IOAPICInfo* get_responsible_ioapic(uint32_t gsi) {
     return (IOAPICInfo*)0;
 }
 
+uint32_t get_cpu_index() {
+    // NOTE: Only the bootstrap processor is started at the moment.
+    // Secondary processors will have to keep their index in processor local storage once they are
+    // brought up.
+    return 0;
+}
+
 bool get_lapic_id(uint8_t acpi_id, uint8_t* lapic_id) {
     for (uint64_t i = 0; i < g_lapic_count; i++) {
         LocalAPICEntry* entry = g_found_lapics[i];
@@ -80,9 +80,9 @@ bool load_elf_from_buff(AddressSpace* addr_space, const void* data, void** entry
             // Make sure segments are 4K aligned
             if ((header->p_vaddr % PAGE_SIZE) != 0) return false;
 
-            // Allocate physical memory
+            // Allocate cleared physical memory acording to ELF spec
             const uint64_t pages = (header->p_memsz + PAGE_SIZE - 1) / PAGE_SIZE;
-            PageFrameAllocation* allocation = alloc_frames(pages);
+            PageFrameAllocation* allocation = alloc_frames(pages, FRAME_ZEROED | FRAME_MOVABLE);
             if (allocation == 0) return false;
 
             // Map memory to address specified by program header
@@ -93,9 +93,6 @@ bool load_elf_from_buff(AddressSpace* addr_space, const void* data, void** entry
                 if (success == false) return false;
             }
 
-            // Clear allocated memory acording to ELF spec
-            memset((void*)header->p_vaddr, 0, pages * PAGE_SIZE);
-
             // Copy over segment data to allocated memory
             memcpy((void*)header->p_vaddr, data + header->p_offset, header->p_filesz);
 
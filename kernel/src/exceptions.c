@@ -3,6 +3,7 @@
 
 #include "idt.h"
 #include "rendering.h"
+#include "memory/paging.h"
 
 #define DIV_BY_ZERO 0
 #define DEBUG 1
@@ -72,6 +73,17 @@ __attribute__((interrupt)) void general_protection_fault(ErrorCodeInterruptFrame
 }
 
 __attribute__((interrupt)) void page_fault(ErrorCodeInterruptFrame* frame) {
+    // CR2 contains the address read that cause the exception
+    uint64_t cr2;
+    asm volatile("mov %%cr2, %0" : "=r"(cr2));
+
+    // Pages of memory areas which aren't present yet are mapped on first touch,
+    // writes to copy on write pages copy them
+    const bool present = (frame->err & 1) != 0;
+    const bool write = (frame->err & 2) != 0;
+    const bool user = (frame->err & 4) != 0;
+    if (handle_page_fault(cr2, present, write, user)) return;
+
     clear_screen(0);
     uint64_t x = 10;
     uint64_t y = 10;
@@ -87,10 +99,6 @@ __attribute__((interrupt)) void page_fault(ErrorCodeInterruptFrame* frame) {
     x += put_hex(frame->rsp, x, y);
     x = 10;
 
-    // CR2 contains the address read that cause the exception
-    uint64_t cr2;
-    asm volatile("mov %%cr2, %0" : "=r"(cr2));
-
     x += put_string("Page fault address: ", x, ++y);
     x += put_hex(cr2, x, y);
     x = 10;
@@ -112,7 +120,8 @@ void register_exception_interrupts() {
     for (int i = 0; i < 0x20; i++)
         register_interrupt(i, INTERRUPT_GATE, false, (void*)&unimplemented_exception);
 
-    register_interrupt(PAGE_FAULT, INTERRUPT_GATE, false, (void*)&page_fault);
+    // Page faults get their own stack, the kernel runs on user stacks which are demand paged
+    register_interrupt(PAGE_FAULT, INTERRUPT_GATE, true, (void*)&page_fault);
     register_interrupt(
         GENERAL_PROTECTION_FAULT, INTERRUPT_GATE, false, (void*)general_protection_fault);
 }
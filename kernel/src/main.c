@@ -1,9 +1,11 @@
 #include "memory/paging.h"
+#include "memory/frame_allocator.h"
 #include "rendering.h"
 #include "memory.h"
 #include "gdt.h"
 #include "idt.h"
 #include "acpi.h"
+#include "numa.h"
 #include "pci.h"
 #include "apic.h"
 #include "exceptions.h"
@@ -59,7 +61,12 @@ _Noreturn void kernel_entry(void* mm, void* fb, PhysicalAddress rsdp) {
     PhysicalAddress kernel_phys_addr;
     PhysicalAddress kernel_virt_addr;
     initialize_memory(mm, &kernel_phys_addr, &kernel_virt_addr);
-    put_string("Memory initialized", 10, 9);
+    {
+        uint64_t x = 10;
+        x += put_string("Memory initialized (frame allocator: ", x, 9);
+        x += put_uint(get_frame_allocator_init_cycles(), x, 9);
+        put_string(" cycles)", x, 9);
+    }
 
     jump_to_kernel_virtual(kernel_phys_addr, kernel_virt_addr);
     put_string("Kernel now running in virtual address space", 10, 10);
@@ -90,25 +97,36 @@ _Noreturn void kernel_entry(void* mm, void* fb, PhysicalAddress rsdp) {
     initialize_acpi(rsdp);
     put_string("ACPI Initialized", 10, 17);
 
+    initialize_numa();
+    {
+        uint64_t x = 10;
+        x += put_string("NUMA initialized (", x, 18);
+        x += put_uint(get_numa_node_count(), x, 18);
+        put_string(" nodes)", x, 18);
+    }
+
     enumerate_pci_devices();
-    put_string("PCI devices enumerated", 10, 18);
+    put_string("PCI devices enumerated", 10, 19);
 
     setup_apic();
-    put_string("APIC(s) set up and usable", 10, 19);
+    put_string("APIC(s) set up and usable", 10, 20);
 
     initialize_ahci();
-    put_string("AHCI Initialized", 10, 20);
+    put_string("AHCI Initialized", 10, 21);
 
     prepare_syscalls();
-    put_string("Syscalls enabled", 10, 21);
+    put_string("Syscalls enabled", 10, 22);
 
     register_ps2_interrupt();
-    put_string("Keyboard initialized", 10, 22);
+    put_string("Keyboard initialized", 10, 23);
 
     initialize_process_system();
-    put_string("Process system initialized", 10, 23);
+    put_string("Process system initialized", 10, 24);
 
     // This function can't return
-    while (1)
-        ;
+    while (1) {
+        // Populate deferred memory and clear free frames ahead of time
+        // while there is nothing else to do
+        if (!populate_deferred_memory() && !refill_zeroed_frames()) asm volatile("hlt");
+    }
 }
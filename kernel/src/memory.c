@@ -7,8 +7,8 @@
 
 uint64_t g_memory_size = 0;
 
-void* alloc_pages(uint64_t pages, PagingFlags paging_flags) {
-    PageFrameAllocation* allocation = alloc_frames(pages);
+void* alloc_mapped_frames(uint64_t pages, FrameFlags frame_flags, PagingFlags paging_flags) {
+    PageFrameAllocation* allocation = alloc_frames(pages, frame_flags);
     if (allocation == 0) return 0;
 
     void* ptr = (void*)kmap_allocation(allocation, paging_flags);
@@ -17,6 +17,14 @@ void* alloc_pages(uint64_t pages, PagingFlags paging_flags) {
     return ptr;
 }
 
+void* alloc_pages(uint64_t pages, PagingFlags paging_flags) {
+    return alloc_mapped_frames(pages, FRAME_CONTIGUOUS, paging_flags);
+}
+
+void* alloc_reclaimable_pages(uint64_t pages, PagingFlags paging_flags) {
+    return alloc_mapped_frames(pages, FRAME_CONTIGUOUS | FRAME_RECLAIMABLE, paging_flags);
+}
+
 void free_pages(void* ptr, uint64_t pages) { kunmap_and_free_frames((VirtualAddress)ptr, pages); }
 
 void* alloc_pages_contiguous(uint64_t pages, PagingFlags paging_flags) {
@@ -26,6 +34,14 @@ void* alloc_pages_contiguous(uint64_t pages, PagingFlags paging_flags) {
     return (void*)kmap_phys_range(phys_addr, pages, paging_flags);
 }
 
+void* alloc_pages_constrained(uint64_t pages, PhysicalAddress max_addr, uint64_t align,
+                              PagingFlags paging_flags) {
+    PhysicalAddress phys_addr;
+    if (!alloc_frames_constrained(pages, max_addr, align, &phys_addr)) return 0;
+
+    return (void*)kmap_phys_range(phys_addr, pages, paging_flags);
+}
+
 void free_pages_contiguous(void* ptr, uint64_t pages) {
     PhysicalAddress phys_addr;
     const bool success = kvirt_to_phys_addr((VirtualAddress)ptr, &phys_addr);
@@ -37,8 +53,33 @@ void free_pages_contiguous(void* ptr, uint64_t pages) {
 
 uint64_t get_memory_size() { return g_memory_size; }
 
+// Sorts the memory map by physical address, UEFI doesn't guarantee any order.
+// The map is almost always sorted already, which makes insertion sort close to linear.
+void sort_uefi_memory_map(UEFIMemoryMap* memory_map) {
+    for (uint64_t i = memory_map->desc_size; i < memory_map->buffer_size;
+         i += memory_map->desc_size) {
+        for (uint64_t j = i; j != 0; j -= memory_map->desc_size) {
+            uint8_t* curr = &memory_map->buffer[j];
+            uint8_t* prev = curr - memory_map->desc_size;
+            if (((UEFIMemoryDescriptor*)prev)->physical_start <=
+                ((UEFIMemoryDescriptor*)curr)->physical_start) {
+                break;
+            }
+
+            // Descriptors can be bigger than UEFIMemoryDescriptor so they are swapped bytewise
+            for (uint64_t k = 0; k < memory_map->desc_size; ++k) {
+                const uint8_t tmp = curr[k];
+                curr[k] = prev[k];
+                prev[k] = tmp;
+            }
+        }
+    }
+}
+
 void initialize_memory(void* uefi_memory_map, PhysicalAddress* kernel_phys_addr,
                        VirtualAddress* kernel_virt_addr) {
+    sort_uefi_memory_map((UEFIMemoryMap*)uefi_memory_map);
+
     // Calculate memory size, get kernel address and kernel size
     uint64_t kernel_size = 0;
     {
@@ -0,0 +1,196 @@
+#include "memory/address_tree.h"
+
+#include "kassert.h"
+#include "util.h"
+
+#include "memory/entry_pool.h"
+
+#include <string.h>
+
+uint8_t get_address_node_height(const AddressNode* node) { return node == 0 ? 0 : node->height; }
+
+// Recalculates the height and whatever the tree keeps about the subtree of a node
+void update_address_node(AddressNode* node, AddressNodeUpdate update) {
+    const uint8_t left_height = get_address_node_height(node->left);
+    node->height = MAX(left_height, get_address_node_height(node->right)) + 1;
+    if (update != 0) update(node);
+}
+
+AddressNode* rotate_address_node_left(AddressNode* node, AddressNodeUpdate update) {
+    AddressNode* right = node->right;
+    node->right = right->left;
+    right->left = node;
+
+    update_address_node(node, update);
+    update_address_node(right, update);
+    return right;
+}
+
+AddressNode* rotate_address_node_right(AddressNode* node, AddressNodeUpdate update) {
+    AddressNode* left = node->left;
+    node->left = left->right;
+    left->right = node;
+
+    update_address_node(node, update);
+    update_address_node(left, update);
+    return left;
+}
+
+// Updates a node whose subtrees changed and rotates it back into balance,
+// returns the node which takes its place
+AddressNode* balance_address_node(AddressNode* node, AddressNodeUpdate update) {
+    update_address_node(node, update);
+
+    AddressNode* left = node->left;
+    AddressNode* right = node->right;
+    const int32_t balance =
+        (int32_t)get_address_node_height(left) - (int32_t)get_address_node_height(right);
+
+    if (balance > 1) {
+        if (get_address_node_height(left->left) < get_address_node_height(left->right)) {
+            node->left = rotate_address_node_left(left, update);
+        }
+
+        return rotate_address_node_right(node, update);
+    }
+
+    if (balance < -1) {
+        if (get_address_node_height(right->right) < get_address_node_height(right->left)) {
+            node->right = rotate_address_node_right(right, update);
+        }
+
+        return rotate_address_node_left(node, update);
+    }
+
+    return node;
+}
+
+AddressNode* insert_address_node(AddressNode* root, AddressNode* node, AddressNodeUpdate update) {
+    if (root == 0) {
+        node->left = 0;
+        node->right = 0;
+        update_address_node(node, update);
+        return node;
+    }
+
+    if (node->addr < root->addr) {
+        root->left = insert_address_node(root->left, node, update);
+    }
+    else {
+        root->right = insert_address_node(root->right, node, update);
+    }
+
+    return balance_address_node(root, update);
+}
+
+// Takes the node with the lowest address out of the tree, returns the new root
+AddressNode* remove_first_address_node(AddressNode* root, AddressNode** out_node,
+                                       AddressNodeUpdate update) {
+    if (root->left == 0) {
+        *out_node = root;
+        return root->right;
+    }
+
+    root->left = remove_first_address_node(root->left, out_node, update);
+    return balance_address_node(root, update);
+}
+
+AddressNode* remove_address_node(AddressNode* root, uint64_t addr, AddressNodeUpdate update) {
+    KERNEL_ASSERT(root != 0, "Node not in address tree")
+
+    if (addr < root->addr) {
+        root->left = remove_address_node(root->left, addr, update);
+    }
+    else if (addr > root->addr) {
+        root->right = remove_address_node(root->right, addr, update);
+    }
+    else {
+        if (root->right == 0) return root->left;
+
+        // The next node takes the place of the removed one
+        AddressNode* next;
+        AddressNode* right = remove_first_address_node(root->right, &next, update);
+        next->left = root->left;
+        next->right = right;
+        root = next;
+    }
+
+    return balance_address_node(root, update);
+}
+
+void update_address_node_path(AddressNode* root, uint64_t addr, AddressNodeUpdate update) {
+    KERNEL_ASSERT(root != 0, "Node not in address tree")
+
+    if (addr < root->addr) {
+        update_address_node_path(root->left, addr, update);
+    }
+    else if (addr > root->addr) {
+        update_address_node_path(root->right, addr, update);
+    }
+
+    update_address_node(root, update);
+}
+
+AddressNode* find_containing_address_node(AddressNode* root, uint64_t addr) {
+    while (root != 0) {
+        if (addr < root->addr) {
+            root = root->left;
+        }
+        else if (addr >= root->addr + root->pages) {
+            root = root->right;
+        }
+        else {
+            return root;
+        }
+    }
+
+    return 0;
+}
+
+AddressNode* find_address_node_below(AddressNode* root, uint64_t addr) {
+    AddressNode* found = 0;
+    while (root != 0) {
+        if (root->addr < addr) {
+            found = root;
+            root = root->right;
+        }
+        else {
+            root = root->left;
+        }
+    }
+
+    return found;
+}
+
+AddressNode* find_address_node_above(AddressNode* root, uint64_t addr) {
+    AddressNode* found = 0;
+    while (root != 0) {
+        if (root->addr >= addr) {
+            found = root;
+            root = root->left;
+        }
+        else {
+            root = root->right;
+        }
+    }
+
+    return found;
+}
+
+void free_address_tree(AddressNode* root, uint8_t pool) {
+    if (root == 0) return;
+
+    free_address_tree(root->left, pool);
+    free_address_tree(root->right, pool);
+    free_pool_entry(pool, root);
+}
+
+AddressNode* copy_address_tree(const AddressNode* root, uint8_t pool, uint64_t size) {
+    if (root == 0) return 0;
+
+    AddressNode* copy = alloc_pool_entry(pool);
+    memcpy(copy, root, size);
+    copy->left = copy_address_tree(root->left, pool, size);
+    copy->right = copy_address_tree(root->right, pool, size);
+    return copy;
+}
@@ -1,48 +1,249 @@
 #include "memory/entry_pool.h"
 
+#include "apic.h"
 #include "kassert.h"
 
-#define ENTRY_THRESHOLD 20
+#include <string.h>
 
+// Number of entries each processor local entry cache can hold
+#define ENTRY_CACHE_SIZE 32
+
+// Number of entries moved between an entry cache and the pool pages at a time
+#define ENTRY_CACHE_BATCH 16
+
+// Free entries a pool keeps in its pages, mapping a new page for a pool takes entries itself
+#define ENTRY_THRESHOLD (20 + ENTRY_CACHE_BATCH)
+
+// Size of the entries of each pool, every size divides a cache line
+const uint64_t c_entry_pool_sizes[ENTRY_POOL_COUNT] = {
+    [ENTRY_POOL_FRAME_ALLOCATIONS] = ENTRY_SIZE,
+    [ENTRY_POOL_FREE_RANGES] = 2 * ENTRY_SIZE,
+    [ENTRY_POOL_MEMORY_AREAS] = 2 * ENTRY_SIZE,
+};
+
+// Every pool page starts with a header taking up one cache line,
+// the entries after it never cross a cache line
+typedef struct {
+    void* next; // Next page with free entries in the pool
+    void* prev;
+    void* free_entries; // Free entries in the page, linked through their first 8 bytes
+    uint32_t free_count;
+    bool reserved; // Memory given at initialization, never returned to the frame allocator
+} __attribute__((aligned(64))) EntryPoolPage;
+
+#define ENTRIES_PER_PAGE(entry_size) ((PAGE_SIZE - sizeof(EntryPoolPage)) / (entry_size))
+
+// Processor local cache of free entries, entries are taken and put back at the end
+typedef struct {
+    void* entries[ENTRY_CACHE_SIZE];
+    uint32_t count;
+} __attribute__((aligned(64))) EntryCache;
+
+typedef struct {
+    EntryCache caches[MAX_LAPIC_COUNT];
+
+    EntryPoolPage* pages; // Pages with free entries
+    uint64_t free_count;  // Free entries in the pages
+    uint64_t page_count;
+
+    // Set while the pool maps or unmaps one of its pages,
+    // which can take entries from the pool itself
+    bool busy;
+
+    uint64_t allocations;
+    uint64_t frees;
+} EntryPool;
+
+EntryPool g_entry_pools[ENTRY_POOL_COUNT] = {0};
+
+// Reserved pages not used by any pool, linked through the next field of the page header
 struct {
+    EntryPoolPage* head;
     uint64_t count;
-    MemoryEntry* head;
-} g_memory_entry_pool = {0};
+} g_reserved_entry_pages = {0};
+
+uint64_t get_entry_size(const EntryPool* pool) { return c_entry_pool_sizes[pool - g_entry_pools]; }
+
+// Splits a page into free entries of the pool, reserved pages are split again for every pool
+// they are given to
+void init_entry_pool_page(EntryPoolPage* page, bool reserved, uint64_t entry_size) {
+    _Static_assert(sizeof(EntryPoolPage) == 64, "EntryPoolPage struct is not 64 bytes");
+
+    page->next = 0;
+    page->prev = 0;
+    page->free_entries = 0;
+    page->free_count = 0;
+    page->reserved = reserved;
+
+    VirtualAddress addr = (VirtualAddress)page + PAGE_SIZE - entry_size;
+    for (uint64_t i = 0; i < ENTRIES_PER_PAGE(entry_size); ++i) {
+        *(void**)addr = page->free_entries;
+        page->free_entries = (void*)addr;
+        ++page->free_count;
+        addr -= entry_size;
+    }
+}
 
 void fill_memory_entry_pool(VirtualAddress addr, uint64_t pages) {
-    _Static_assert(sizeof(MemoryEntry) == 16, "MemoryEntry struct is not 16 bytes");
+    for (uint64_t i = 0; i < pages; ++i) {
+        EntryPoolPage* page = (EntryPoolPage*)addr;
+        page->reserved = true;
+
+        page->next = g_reserved_entry_pages.head;
+        g_reserved_entry_pages.head = page;
+        ++g_reserved_entry_pages.count;
+
+        addr += PAGE_SIZE;
+    }
+}
+
+// Puts a page at the front of the pages with free entries
+void link_entry_pool_page(EntryPool* pool, EntryPoolPage* page) {
+    page->prev = 0;
+    page->next = pool->pages;
+    if (pool->pages != 0) pool->pages->prev = page;
+    pool->pages = page;
+}
 
-    const uint64_t count = (pages * PAGE_SIZE) / sizeof(MemoryEntry);
-    for (uint64_t i = 0; i < count; ++i) {
-        MemoryEntry* entry = (MemoryEntry*)addr;
-        entry->next = g_memory_entry_pool.head;
-        g_memory_entry_pool.head = entry;
-        addr += sizeof(MemoryEntry);
+void unlink_entry_pool_page(EntryPool* pool, EntryPoolPage* page) {
+    if (page->prev == 0) {
+        pool->pages = page->next;
     }
-    g_memory_entry_pool.count += count;
+    else {
+        ((EntryPoolPage*)page->prev)->next = page->next;
+    }
+
+    if (page->next != 0) ((EntryPoolPage*)page->next)->prev = page->prev;
 }
 
-MemoryEntry* get_memory_entry() {
-    if (g_memory_entry_pool.count < ENTRY_THRESHOLD) {
-        g_memory_entry_pool.count += ENTRY_THRESHOLD;
+// Gives the pool another page, reserved pages are used before new memory is allocated
+void grow_entry_pool(EntryPool* pool) {
+    EntryPoolPage* page = g_reserved_entry_pages.head;
+    if (page != 0) {
+        g_reserved_entry_pages.head = page->next;
+        --g_reserved_entry_pages.count;
+    }
+    else {
+        pool->busy = true;
+        page = alloc_pages(1, PAGING_WRITABLE);
+        pool->busy = false;
+        KERNEL_ASSERT(page != 0, "Out of memory")
+
+        page->reserved = false;
+    }
+
+    init_entry_pool_page(page, page->reserved, get_entry_size(pool));
 
-        void* memory = alloc_pages(1, PAGING_WRITABLE);
-        KERNEL_ASSERT(memory != 0, "Out of memory")
+    link_entry_pool_page(pool, page);
+    pool->free_count += page->free_count;
+    ++pool->page_count;
+}
 
-        fill_memory_entry_pool((VirtualAddress)memory, 1);
+// Takes a page where every entry is free away from the pool
+void shrink_entry_pool(EntryPool* pool, EntryPoolPage* page) {
+    unlink_entry_pool_page(pool, page);
+    pool->free_count -= page->free_count;
+    --pool->page_count;
 
-        g_memory_entry_pool.count -= ENTRY_THRESHOLD;
+    if (page->reserved) {
+        page->next = g_reserved_entry_pages.head;
+        g_reserved_entry_pages.head = page;
+        ++g_reserved_entry_pages.count;
+        return;
     }
 
-    MemoryEntry* entry = g_memory_entry_pool.head;
-    g_memory_entry_pool.head = entry->next;
-    entry->next = 0;
-    --g_memory_entry_pool.count;
+    pool->busy = true;
+    free_pages(page, 1);
+    pool->busy = false;
+}
+
+void* take_page_entry(EntryPool* pool) {
+    EntryPoolPage* page = pool->pages;
+
+    void* entry = page->free_entries;
+    page->free_entries = *(void**)entry;
+    --page->free_count;
+    --pool->free_count;
+
+    if (page->free_count == 0) unlink_entry_pool_page(pool, page);
     return entry;
 }
 
-void free_memory_entry(MemoryEntry* entry) {
-    ++g_memory_entry_pool.count;
-    entry->next = g_memory_entry_pool.head;
-    g_memory_entry_pool.head = entry;
+void put_page_entry(EntryPool* pool, void* entry) {
+    // Pages are page aligned so the header is found from the entry address
+    EntryPoolPage* page = (EntryPoolPage*)((VirtualAddress)entry & ~(PAGE_SIZE - 1));
+
+    *(void**)entry = page->free_entries;
+    page->free_entries = entry;
+    if (page->free_count++ == 0) link_entry_pool_page(pool, page);
+    ++pool->free_count;
+
+    // Give the page back once the pool has enough free entries without it
+    const uint64_t entries_per_page = ENTRIES_PER_PAGE(get_entry_size(pool));
+    if (page->free_count == entries_per_page && !pool->busy &&
+        pool->free_count >= entries_per_page + ENTRY_THRESHOLD) {
+        shrink_entry_pool(pool, page);
+    }
+}
+
+// Moves ENTRY_CACHE_BATCH entries from the pool pages to the entry cache
+void refill_entry_cache(EntryPool* pool, EntryCache* cache) {
+    // While the pool is busy it lives off the entries kept in reserve
+    if (pool->free_count < ENTRY_THRESHOLD && !pool->busy) grow_entry_pool(pool);
+
+    for (uint64_t i = 0; i < ENTRY_CACHE_BATCH && pool->free_count != 0; ++i) {
+        cache->entries[cache->count++] = take_page_entry(pool);
+    }
+
+    KERNEL_ASSERT(cache->count != 0, "Out of memory entries")
+}
+
+// Moves up to count entries from the entry cache back to the pool pages
+void drain_entry_cache(EntryPool* pool, EntryCache* cache, uint64_t count) {
+    for (; count != 0 && cache->count != 0; --count) {
+        put_page_entry(pool, cache->entries[--cache->count]);
+    }
+}
+
+void* alloc_pool_entry(uint8_t pool_index) {
+    KERNEL_ASSERT(pool_index < ENTRY_POOL_COUNT, "Not an entry pool")
+
+    EntryPool* pool = &g_entry_pools[pool_index];
+    ++pool->allocations;
+
+    EntryCache* cache = &pool->caches[get_cpu_index()];
+    if (cache->count == 0) refill_entry_cache(pool, cache);
+
+    void* entry = cache->entries[--cache->count];
+    memset(entry, 0, get_entry_size(pool));
+    return entry;
+}
+
+void free_pool_entry(uint8_t pool_index, void* entry) {
+    KERNEL_ASSERT(pool_index < ENTRY_POOL_COUNT, "Not an entry pool")
+
+    EntryPool* pool = &g_entry_pools[pool_index];
+    ++pool->frees;
+
+    EntryCache* cache = &pool->caches[get_cpu_index()];
+    if (cache->count == ENTRY_CACHE_SIZE) drain_entry_cache(pool, cache, ENTRY_CACHE_BATCH);
+
+    cache->entries[cache->count++] = entry;
+}
+
+void get_entry_pool_stats(uint8_t pool_index, EntryPoolStats* out_stats) {
+    KERNEL_ASSERT(pool_index < ENTRY_POOL_COUNT, "Not an entry pool")
+
+    const EntryPool* pool = &g_entry_pools[pool_index];
+    out_stats->allocations = pool->allocations;
+    out_stats->frees = pool->frees;
+    out_stats->entries_in_use = pool->allocations - pool->frees;
+
+    out_stats->cached_entries = 0;
+    for (uint64_t i = 0; i < MAX_LAPIC_COUNT; ++i) {
+        out_stats->cached_entries += pool->caches[i].count;
+    }
+
+    out_stats->free_entries = pool->free_count;
+    out_stats->pages = pool->page_count;
 }
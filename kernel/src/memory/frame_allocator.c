@@ -2,6 +2,8 @@
 
 #include "uefi.h"
 #include "util.h"
+#include "apic.h"
+#include "numa.h"
 #include "kassert.h"
 #include "memory.h"
 #include "memory/entry_pool.h"
@@ -10,20 +12,194 @@
 
 #define MIN_FRAME_ORDER_SIZE PAGE_SIZE
 
-// Free list entry
-typedef struct {
-    void* next;
-    uint64_t addr;
-} ListEntry;
+// Marks the end of a free list
+#define FRAME_NONE 0xffffffffU
+
+// Frame descriptor flags
+#define FRAME_FREE 1
+// Mapped frame which compaction is allowed to move
+#define FRAME_COMPACT 2
+// Allocated frame mapped by more than one address space, the owners are counted in the descriptor
+#define FRAME_SHARED 4
+
+// Number of frames each processor local frame cache can hold (has to be a power of 2)
+#define FRAME_CACHE_SIZE 64
+
+// Number of frames moved between a frame cache and the free lists at a time
+#define FRAME_CACHE_BATCH 16
+
+// Number of cleared frames kept ready for allocations which need zeroed memory,
+// per migrate type which has a zeroed frame pool
+#define ZEROED_FRAME_TARGET 256
+
+// Number of frames reserved at initialization for contiguos allocations (16MiB),
+// serves requests which are too big for the buddy allocator or when memory is fragmented
+#define DMA_REGION_FRAMES 4096
+
+// Highest address the DMA region can end at, keeps it usable for 32-bit devices
+#define DMA_REGION_MAX_ADDR DMA32_ZONE_END
+
+// Physical memory zones, blocks never cross a zone boundary since the 4GiB boundary
+// is aligned to the largest block size
+#define ZONE_DMA32 0
+#define ZONE_NORMAL 1
+#define ZONE_COUNT 2
 
-// Free lists for all block sizes
+// End of the zone for devices which can only address 32 bits
+#define DMA32_ZONE_END 0x100000000ULL
+
+// Migrate types, frames are grouped into pageblocks by whether they can be moved or given back
+// so that frames which never move don't end up scattered over all of memory
+#define MIGRATE_UNMOVABLE 0
+#define MIGRATE_RECLAIMABLE 1
+#define MIGRATE_MOVABLE 2
+#define MIGRATE_TYPES 3
+
+// Order of the blocks migrate types are tracked for (2MiB)
+#define PAGEBLOCK_ORDER (FRAME_ORDERS > 9 ? 9 : FRAME_ORDERS - 1)
+
+// Pageblock type of memory which hasn't been put in the free lists yet,
+// the frame descriptors of deferred pageblocks aren't initialized
+#define PAGEBLOCK_DEFERRED MIGRATE_TYPES
+
+// Free memory put in the free lists at initialization (256MiB), the rest is populated
+// a pageblock at a time when idle or when an allocation runs out of memory
+#define INITIAL_POPULATED_FRAMES 65536
+
+// Descriptor for every page frame in physical memory, indexed by frame number.
+// Free lists are linked through the descriptors of the first frame in each free block,
+// which makes it possible to find and unlink any free block in constant time.
+typedef struct {
+    uint32_t next; // Frame number of the next block in the free list
+    union {
+        uint32_t prev;   // Frame number of the previous block in the free list
+        uint32_t owners; // Owners of a shared frame, only valid while FRAME_SHARED is set
+        uint32_t table_entries; // Present entries of a frame used as a page table
+    };
+    uint8_t order; // Order of the free block starting at this frame
+    uint8_t flags;
+    uint8_t node;         // NUMA node the frame belongs to
+    uint8_t migrate_type; // Migrate type of the free list the block is in
+} FrameDescriptor;
+
+// Free lists for all block sizes, with one list per NUMA node, zone and migrate type
 struct {
-    ListEntry* head;
+    uint32_t heads[MAX_NUMA_NODES][ZONE_COUNT][MIGRATE_TYPES];
     uint64_t* buddy_map;
+    uint64_t count; // Free blocks of this order in all lists
 } g_free_lists[FRAME_ORDERS] = {0};
 
 uint64_t g_frame_order_sizes[FRAME_ORDERS];
 
+FrameDescriptor* g_frame_descriptors = 0;
+uint64_t g_frame_count = 0;
+
+// Migrate type of every pageblock, indexed by frame number >> PAGEBLOCK_ORDER
+uint8_t* g_pageblock_types = 0;
+
+// Migrate types to take free blocks from when a migrate type has run out, in order
+const uint8_t c_migrate_fallbacks[MIGRATE_TYPES][MIGRATE_TYPES - 1] = {
+    [MIGRATE_UNMOVABLE] = {MIGRATE_RECLAIMABLE, MIGRATE_MOVABLE},
+    [MIGRATE_RECLAIMABLE] = {MIGRATE_UNMOVABLE, MIGRATE_MOVABLE},
+    [MIGRATE_MOVABLE] = {MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE},
+};
+
+// Time stamp counter cycles spent in initialize_frame_allocator
+uint64_t g_frame_allocator_init_cycles = 0;
+
+// Pages used by the entry pool, buddy maps, frame descriptors and pageblock types
+uint64_t g_frame_allocator_metadata_pages = 0;
+
+// Processor local cache of single page frames, stored as a ring buffer.
+// Recently freed (cache hot) frames are put at the front and handed out first,
+// while cold frames are put at the back and returned to the free lists first.
+typedef struct {
+    uint32_t frames[FRAME_CACHE_SIZE];
+    uint32_t front; // Index of the first frame in the ring buffer
+    uint32_t count;
+} __attribute__((aligned(64))) FrameCache;
+
+// Every processor has one cache per migrate type
+FrameCache g_frame_caches[MAX_LAPIC_COUNT][MIGRATE_TYPES] = {0};
+
+// NUMA nodes known to the allocator, all memory belongs to node 0 until the topology is read
+uint8_t g_node_count = 1;
+
+// Nodes ordered by distance from every node, used as fallback order for allocations
+uint8_t g_node_fallbacks[MAX_NUMA_NODES][MAX_NUMA_NODES] = {0};
+
+// Allocator event counters, rates are calculated by the user from two snapshots
+struct {
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t splits;
+    uint64_t merges;
+} g_frame_stats = {0};
+
+// Processor local allocation policy
+typedef struct {
+    uint8_t mode;
+    uint8_t node;
+} FramePolicy;
+
+FramePolicy g_frame_policies[MAX_LAPIC_COUNT] = {0};
+
+// Pageblocks left out of the free lists at initialization, populated in address order
+struct {
+    uint64_t next; // Pageblock to continue looking for deferred pageblocks from
+    uint64_t count;
+} g_deferred_pageblocks = {0};
+
+// Frames which have been cleared ahead of time, linked through their frame descriptors.
+// Every migrate type has its own pool, filled from pageblocks of that type
+struct {
+    uint32_t head;
+    uint64_t count;
+} g_zeroed_frames[MIGRATE_TYPES] = {0};
+
+// Page tables take unmovable zeroed frames, ELF segments and demand paged user memory take
+// movable ones. Nothing asks for reclaimable zeroed frames
+const uint64_t c_zeroed_frame_targets[MIGRATE_TYPES] = {
+    [MIGRATE_UNMOVABLE] = ZEROED_FRAME_TARGET,
+    [MIGRATE_RECLAIMABLE] = 0,
+    [MIGRATE_MOVABLE] = ZEROED_FRAME_TARGET,
+};
+
+// Memory reserved for contiguos allocations, allocated first fit with one bit per frame
+struct {
+    uint64_t frame;
+    uint64_t count;
+    uint64_t bitmap[DMA_REGION_FRAMES / 64];
+} g_dma_region = {0};
+
+// Disables interrupts, returns the previous RFLAGS to give to restore_interrupts.
+// Callers may already run with interrupts disabled, so they are never just enabled again
+uint64_t disable_interrupts() {
+    uint64_t rflags;
+    asm volatile("pushfq\n"
+                 "pop %[rflags]\n"
+                 "cli"
+                 : [rflags] "=r"(rflags)
+                 :
+                 : "memory");
+
+    return rflags;
+}
+
+void restore_interrupts(uint64_t rflags) {
+    asm volatile("push %[rflags]\n"
+                 "popfq"
+                 :
+                 : [rflags] "r"(rflags)
+                 : "memory", "cc");
+}
+
+uint64_t get_frame_allocator_init_cycles() { return g_frame_allocator_init_cycles; }
+
+uint64_t get_frame_allocator_metadata_size() {
+    return g_frame_allocator_metadata_pages * PAGE_SIZE;
+}
+
 uint64_t get_frame_order_size(uint8_t order) {
     KERNEL_ASSERT(order < FRAME_ORDERS, "Not an order")
     return g_frame_order_sizes[order];
@@ -52,334 +228,973 @@ uint64_t calculate_allocation_pages(PageFrameAllocation* allocation) {
     return size / PAGE_SIZE;
 }
 
+PageFrameAllocation* get_allocation_run(PageFrameAllocation* allocation, uint64_t* out_pages) {
+    const PhysicalAddress start = allocation->addr;
+    PhysicalAddress end = start;
+    while (allocation != 0 && allocation->addr == end) {
+        end += get_frame_order_size(allocation->order);
+        allocation = allocation->next;
+    }
+
+    *out_pages = (end - start) / PAGE_SIZE;
+    return allocation;
+}
+
+uint64_t calculate_allocation_runs(PageFrameAllocation* allocation) {
+    uint64_t runs = 0;
+    PhysicalAddress end = 0;
+    while (allocation != 0) {
+        if (runs == 0 || allocation->addr != end) ++runs;
+
+        end = allocation->addr + get_frame_order_size(allocation->order);
+        allocation = allocation->next;
+    }
+    return runs;
+}
+
 void free_frame_allocation_entries(PageFrameAllocation* allocations) {
     while (allocations != 0) {
-        MemoryEntry* memory_entry = (MemoryEntry*)allocations;
-        allocations = allocations->next;
-        free_memory_entry(memory_entry);
+        PageFrameAllocation* next = allocations->next;
+        free_pool_entry(ENTRY_POOL_FRAME_ALLOCATIONS, allocations);
+        allocations = next;
     }
 }
 
-// Calculate array index and bit index for buddy corresponding to address and order
-void calc_buddy_index(uint64_t addr, uint8_t order, uint64_t* arr_index, uint8_t* bit_index) {
+// Calculate array index and bit index for buddy corresponding to frame and order
+void calc_buddy_index(uint64_t frame, uint8_t order, uint64_t* arr_index, uint8_t* bit_index) {
     KERNEL_ASSERT(order < (FRAME_ORDERS - 1), "Order does not have a buddy map")
-    *arr_index = addr / g_frame_order_sizes[order];
-    *arr_index -= (*arr_index) % 2;
-    *arr_index /= 2;
 
-    *bit_index = (*arr_index) & 0b111111;
-    *arr_index &= ~0b111111;
+    // Both blocks in a buddy pair share one bit
+    const uint64_t pair_index = frame >> (order + 1);
 
-    *arr_index /= 64;
+    *arr_index = pair_index / 64;
+    *bit_index = pair_index % 64;
 }
 
-bool get_buddy_bit(uint64_t addr, uint8_t order) {
+bool get_buddy_bit(uint64_t frame, uint8_t order) {
     uint64_t arr_index;
     uint8_t bit_index;
-    calc_buddy_index(addr, order, &arr_index, &bit_index);
+    calc_buddy_index(frame, order, &arr_index, &bit_index);
 
     return (g_free_lists[order].buddy_map[arr_index] >> bit_index) & 1;
 }
 
-void toggle_buddy_bit(uint64_t addr, uint8_t order) {
+void toggle_buddy_bit(uint64_t frame, uint8_t order) {
     // The last order does not have a buddy map
     if (order == FRAME_ORDERS - 1) return;
 
     uint64_t arr_index;
     uint8_t bit_index;
-    calc_buddy_index(addr, order, &arr_index, &bit_index);
+    calc_buddy_index(frame, order, &arr_index, &bit_index);
 
     g_free_lists[order].buddy_map[arr_index] ^= (1ULL << bit_index);
 }
 
-void split_entry(ListEntry* entry, uint8_t order) {
-    // Toogle buddy bit to mark block as allocated
-    toggle_buddy_bit(entry->addr, order);
+// Size of the buddy map for order in bytes
+uint64_t get_buddy_map_size(uint8_t order) {
+    // One bit per buddy pair, a pair at the end of memory might only have its left block
+    const uint64_t pairs = (g_frame_count + (2ULL << order) - 1) >> (order + 1);
 
-    ListEntry* left = entry;
-    ListEntry* right = (ListEntry*)get_memory_entry();
+    // The map is accessed a 64-bit word at a time
+    return round_up_to_multiple(pairs, 64) / 8;
+}
+
+uint8_t get_frame_zone(uint64_t frame) {
+    return frame < (DMA32_ZONE_END / PAGE_SIZE) ? ZONE_DMA32 : ZONE_NORMAL;
+}
 
-    right->addr = left->addr + g_frame_order_sizes[order - 1];
-    right->next = g_free_lists[order - 1].head;
+uint8_t get_pageblock_type(uint64_t frame) { return g_pageblock_types[frame >> PAGEBLOCK_ORDER]; }
 
-    left->next = right;
-    g_free_lists[order - 1].head = left;
+uint8_t get_flags_migrate_type(FrameFlags flags) {
+    if ((flags & FRAME_MOVABLE) != 0) return MIGRATE_MOVABLE;
+    if ((flags & FRAME_RECLAIMABLE) != 0) return MIGRATE_RECLAIMABLE;
+    return MIGRATE_UNMOVABLE;
 }
 
-PageFrameAllocation* alloc_frames(uint64_t pages) {
-    uint64_t size = pages * PAGE_SIZE;
+// Puts the block starting at frame at the front of the free list for order,
+// the block goes in the list for the migrate type of the pageblock it starts in
+void push_free_block(uint64_t frame, uint8_t order) {
+    FrameDescriptor* desc = &g_frame_descriptors[frame];
+    desc->order = order;
+    desc->flags = (desc->flags & ~FRAME_SHARED) | FRAME_FREE;
+    desc->migrate_type = get_pageblock_type(frame);
 
-    // Allocation list which will be returned to caller
-    PageFrameAllocation* front = 0;
-    PageFrameAllocation* back = 0;
+    uint32_t* head =
+        &g_free_lists[order].heads[desc->node][get_frame_zone(frame)][desc->migrate_type];
 
-    // Loop until enough memory has been allocated
-    while (size != 0) {
-        // Get biggest order which fits into allocations size
-        int8_t order_to_alloc = 0;
-        while (order_to_alloc < FRAME_ORDERS) {
-            // Size big enough for order
-            if (size < g_frame_order_sizes[order_to_alloc]) break;
-
-            ++order_to_alloc;
-        }
-        --order_to_alloc;
-
-        // Split bigger blocks if none of the correct size are available
-        // or create allocation from smaller blocks
-        {
-            int8_t order = order_to_alloc + 1;
-            while (g_free_lists[order_to_alloc].head == 0) {
-                if (g_free_lists[order].head == 0) {
-                    ++order;
-
-                    if (order < FRAME_ORDERS) continue;
-
-                    // Allocate from smaller blocks because no bigger are available
-                    --order_to_alloc;
-                    while (order_to_alloc >= 0) {
-                        if (g_free_lists[order_to_alloc].head != 0) break;
-                        --order_to_alloc;
-                    }
+    desc->prev = FRAME_NONE;
+    desc->next = *head;
+    if (desc->next != FRAME_NONE) g_frame_descriptors[desc->next].prev = frame;
 
-                    // Cleanup allocation if we are out of memory
-                    if (order_to_alloc < 0) {
-                        free_frames(front);
-                        return 0;
-                    }
+    *head = frame;
+    ++g_free_lists[order].count;
+}
 
-                    break;
-                }
+// Unlinks the free block starting at frame from its free list
+void remove_free_block(uint64_t frame) {
+    FrameDescriptor* desc = &g_frame_descriptors[frame];
+    KERNEL_ASSERT((desc->flags & FRAME_FREE) != 0, "Frame is not the start of a free block")
+
+    if (desc->prev == FRAME_NONE) {
+        g_free_lists[desc->order].heads[desc->node][get_frame_zone(frame)][desc->migrate_type] =
+            desc->next;
+    }
+    else {
+        g_frame_descriptors[desc->prev].next = desc->next;
+    }
 
-                // Remove entry from free list
-                ListEntry* entry = g_free_lists[order].head;
-                g_free_lists[order].head = entry->next;
+    if (desc->next != FRAME_NONE) g_frame_descriptors[desc->next].prev = desc->prev;
 
-                split_entry(entry, order);
+    desc->flags &= ~FRAME_FREE;
+    --g_free_lists[desc->order].count;
+}
 
-                --order;
-            }
+// Checks if frame is the start of a free block of the specified order
+bool is_free_block(uint64_t frame, uint8_t order) {
+    const FrameDescriptor* desc = &g_frame_descriptors[frame];
+    return (desc->flags & FRAME_FREE) != 0 && desc->order == order;
+}
+
+// Finds the free block which contains frame
+// Returns false if frame is not part of any free block
+bool find_free_block(uint64_t frame, uint64_t* block_frame, uint8_t* block_order) {
+    // A free block of any order has to start at frame rounded down to the block size
+    for (uint8_t order = 0; order < FRAME_ORDERS; ++order) {
+        const uint64_t block = frame & ~((1ULL << order) - 1);
+
+        // Deferred frames are never part of a free block, bigger blocks would contain them too
+        if (get_pageblock_type(block) == PAGEBLOCK_DEFERRED) return false;
+
+        if (is_free_block(block, order)) {
+            *block_frame = block;
+            *block_order = order;
+            return true;
         }
+    }
 
-        // Get first block of appropriate size
-        ListEntry* entry = g_free_lists[order_to_alloc].head;
+    return false;
+}
 
-        // Remove block from free list
-        g_free_lists[order_to_alloc].head = entry->next;
+// Checks if the range has frames from more than one NUMA node
+bool range_crosses_nodes(uint64_t frame, uint64_t count) {
+    if (g_node_count == 1) return false;
 
-        // Toogle buddy bit to mark block as allocated
-        toggle_buddy_bit(entry->addr, order_to_alloc);
+    for (uint64_t i = 0; i < get_numa_memory_range_count(); ++i) {
+        const NUMAMemoryRange* range = get_numa_memory_range(i);
+        const uint64_t start = range->base / PAGE_SIZE;
+        const uint64_t end = start + range->size / PAGE_SIZE;
 
-        // Add allocation to allocation list
-        {
-            PhysicalAddress entry_addr = entry->addr;
-            if (front == 0) {
-                front = (PageFrameAllocation*)entry;
-                back = front;
-            }
-            else {
-                PageFrameAllocation* allocation = (PageFrameAllocation*)entry;
-                back->next = allocation;
-                back = allocation;
-            }
+        if (bound_contains(start, frame + 1, frame + count)) return true;
+        if (bound_contains(end, frame + 1, frame + count)) return true;
+    }
+
+    return false;
+}
+
+// Order of the largest naturally aligned block which starts at frame and fits in count frames
+// The block never contains frames from more than one NUMA node
+uint8_t get_range_block_order(uint64_t frame, uint64_t count) {
+    uint8_t order = 0;
+    while (order < (FRAME_ORDERS - 1) && (frame & (1ULL << order)) == 0 &&
+           (2ULL << order) <= count) {
+        ++order;
+    }
+
+    while (order > 0 && range_crosses_nodes(frame, 1ULL << order)) --order;
+    return order;
+}
+
+// Splits a block, which has been removed from its free list, into two blocks one order lower.
+// The half which doesn't contain keep_frame is put into the free list and the other is returned.
+uint64_t split_block(uint64_t frame, uint8_t order, uint64_t keep_frame) {
+    ++g_frame_stats.splits;
+
+    // Toogle buddy bit to mark block as allocated
+    toggle_buddy_bit(frame, order);
+
+    const uint64_t right = frame + (1ULL << (order - 1));
+    if (keep_frame >= right) {
+        push_free_block(frame, order - 1);
+        return right;
+    }
+
+    push_free_block(right, order - 1);
+    return frame;
+}
+
+// Removes a free block from its free list and splits it until only a block of order is left
+uint64_t take_free_block(uint64_t frame, uint8_t block_order, uint8_t order) {
+    remove_free_block(frame);
 
-            back->addr = entry_addr;
-            back->order = order_to_alloc;
-            back->next = 0;
+    for (; block_order > order; --block_order) {
+        frame = split_block(frame, block_order, frame);
+    }
+
+    // Toogle buddy bit to mark block as allocated
+    toggle_buddy_bit(frame, order);
+
+    return frame;
+}
+
+// Allocates a block of the specified order from the free lists of node, zone and migrate type,
+// splitting bigger blocks if none are available
+// Returns false if no block big enough is available
+bool alloc_list_block(uint8_t node, uint8_t zone, uint8_t migrate_type, uint8_t order,
+                      uint64_t* out_frame) {
+    uint8_t curr_order = order;
+    while (g_free_lists[curr_order].heads[node][zone][migrate_type] == FRAME_NONE) {
+        if (++curr_order >= FRAME_ORDERS) return false;
+    }
+
+    *out_frame = take_free_block(
+        g_free_lists[curr_order].heads[node][zone][migrate_type], curr_order, order);
+    return true;
+}
+
+// Changes the migrate type of the pageblock containing frame,
+// moving the free blocks in it to the free lists of the new migrate type
+void claim_pageblock(uint64_t frame, uint8_t migrate_type) {
+    const uint64_t start = frame & ~((1ULL << PAGEBLOCK_ORDER) - 1);
+    const uint64_t end = MIN(start + (1ULL << PAGEBLOCK_ORDER), g_frame_count);
+
+    g_pageblock_types[start >> PAGEBLOCK_ORDER] = migrate_type;
+
+    for (uint64_t curr = start; curr < end;) {
+        if ((g_frame_descriptors[curr].flags & FRAME_FREE) == 0) {
+            ++curr;
+            continue;
         }
 
-        size -= g_frame_order_sizes[order_to_alloc];
+        const uint8_t order = g_frame_descriptors[curr].order;
+        remove_free_block(curr);
+        push_free_block(curr, order);
+        curr += 1ULL << order;
     }
+}
 
-    return front;
+// Finds a free block of order in the free lists of the fallback migrate types
+bool find_fallback_block(uint8_t node, uint8_t zone, uint8_t migrate_type, uint8_t order,
+                         uint64_t* out_frame) {
+    for (uint8_t i = 0; i < MIGRATE_TYPES - 1; ++i) {
+        const uint8_t fallback_type = c_migrate_fallbacks[migrate_type][i];
+        const uint32_t frame = g_free_lists[order].heads[node][zone][fallback_type];
+        if (frame != FRAME_NONE) {
+            *out_frame = frame;
+            return true;
+        }
+    }
+
+    return false;
 }
 
-void free_frames(PageFrameAllocation* allocation) {
-    // Loop until all allocations have been freed
-    while (allocation != 0) {
-        uint8_t order = allocation->order;
+// Allocates a block of the specified order from the free lists of other migrate types
+// Returns false if no migrate type in node and zone has a block big enough
+bool steal_list_block(uint8_t node, uint8_t zone, uint8_t migrate_type, uint8_t order,
+                      uint64_t* out_frame) {
+    uint64_t frame;
+
+    // A whole free pageblock changes type without mixing migrate types,
+    // the smallest one is used to keep bigger blocks intact
+    for (uint8_t curr_order = MAX(order, PAGEBLOCK_ORDER); curr_order < FRAME_ORDERS;
+         ++curr_order) {
+        if (!find_fallback_block(node, zone, migrate_type, curr_order, &frame)) continue;
+
+        // Only the pageblocks the allocation ends up in change type,
+        // the rest of the block goes back to the lists it came from
+        const uint64_t end = frame + (1ULL << MAX(order, PAGEBLOCK_ORDER));
+        for (uint64_t curr = frame; curr < end; curr += 1ULL << PAGEBLOCK_ORDER) {
+            g_pageblock_types[curr >> PAGEBLOCK_ORDER] = migrate_type;
+        }
 
-        KERNEL_ASSERT(order < FRAME_ORDERS, "Not an order")
+        *out_frame = take_free_block(frame, curr_order, order);
+        return true;
+    }
 
-        // Convert allocation to entry
-        ListEntry* entry = (ListEntry*)allocation;
-        entry->addr = allocation->addr;
+    // Otherwise the biggest part of a pageblock is used, and the whole pageblock is taken over.
+    // Movable allocations don't take over pageblocks from a part of it, the rest of the pageblock
+    // might not be memory the allocator manages and compaction would try to move it.
+    for (int8_t curr_order = PAGEBLOCK_ORDER - 1; curr_order >= order; --curr_order) {
+        if (!find_fallback_block(node, zone, migrate_type, curr_order, &frame)) continue;
 
-        // Get next allocation
-        allocation = allocation->next;
+        if (migrate_type != MIGRATE_MOVABLE) claim_pageblock(frame, migrate_type);
 
-        // Toogle buddy bit to mark block as freed
-        toggle_buddy_bit(entry->addr, order);
+        *out_frame = take_free_block(frame, curr_order, order);
+        return true;
+    }
 
-        // Add entry back to free list
-        entry->next = g_free_lists[order].head;
-        g_free_lists[order].head = entry;
+    return false;
+}
 
-        // Merge blocks as far up as possible
-        while (order < (FRAME_ORDERS - 1) && !get_buddy_bit(entry->addr, order)) {
-            // Remove entry from free list
-            g_free_lists[order].head = entry->next;
+// Gets the nodes the processor local policy allows allocating from, closest node first
+uint8_t get_policy_nodes(const uint8_t** out_nodes) {
+    const FramePolicy* policy = &g_frame_policies[get_cpu_index()];
+    *out_nodes = g_node_fallbacks[policy->node];
 
-            uint64_t other_addr = entry->addr;
-            if (entry->addr % g_frame_order_sizes[order + 1] == 0) {
-                other_addr += g_frame_order_sizes[order];
-            }
-            else {
-                other_addr -= g_frame_order_sizes[order];
-            }
+    return policy->mode == FRAME_POLICY_BIND ? 1 : g_node_count;
+}
 
-            ListEntry* buddy_entry = g_free_lists[order].head;
-            ListEntry* last_entry = 0;
-            while (buddy_entry != 0 && buddy_entry->addr != other_addr) {
-                last_entry = buddy_entry;
-                buddy_entry = buddy_entry->next;
-            }
+// Allocates a block of the specified order from any zone in the nodes allowed by the policy
+// Higher zones are used first so that low memory stays available for devices which need it,
+// other migrate types are only used once a zone has nothing left of migrate_type
+bool alloc_block(uint8_t order, uint8_t migrate_type, uint64_t* out_frame) {
+    const uint8_t* nodes;
+    const uint8_t node_count = get_policy_nodes(&nodes);
+    for (uint8_t i = 0; i < node_count; ++i) {
+        for (int8_t zone = ZONE_COUNT - 1; zone >= 0; --zone) {
+            if (alloc_list_block(nodes[i], zone, migrate_type, order, out_frame)) return true;
+            if (steal_list_block(nodes[i], zone, migrate_type, order, out_frame)) return true;
+        }
+    }
 
-            // The buddy entry should always be present or something has gone terribly wrong
-            KERNEL_ASSERT(buddy_entry != 0, "Buddy entry not present")
+    return false;
+}
 
-            // Remove other entry from free list
-            if (buddy_entry == g_free_lists[order].head) {
-                g_free_lists[order].head = buddy_entry->next;
-            }
-            else {
-                last_entry->next = buddy_entry->next;
+// Takes an unmovable block of the specified order which ends at or below limit_frame
+// from the free lists
+bool take_block_below(uint8_t order, uint64_t limit_frame, uint64_t* out_frame) {
+    const uint8_t* nodes;
+    const uint8_t node_count = get_policy_nodes(&nodes);
+    for (uint8_t i = 0; i < node_count; ++i) {
+        const uint8_t node = nodes[i];
+        for (int8_t zone = ZONE_COUNT - 1; zone >= 0; --zone) {
+            const uint64_t zone_start = zone == ZONE_DMA32 ? 0 : DMA32_ZONE_END / PAGE_SIZE;
+            const uint64_t zone_end =
+                zone == ZONE_DMA32 ? DMA32_ZONE_END / PAGE_SIZE : g_frame_count;
+
+            if (zone_start >= limit_frame) continue;
+
+            // Every block in the zone is below the limit
+            if (zone_end <= limit_frame) {
+                if (alloc_list_block(node, zone, MIGRATE_UNMOVABLE, order, out_frame)) return true;
+                if (steal_list_block(node, zone, MIGRATE_UNMOVABLE, order, out_frame)) return true;
+                continue;
             }
 
-            // Swap entries if the buddy entry is on the left
-            if (other_addr < entry->addr) {
-                ListEntry* tmp = buddy_entry;
-                buddy_entry = entry;
-                entry = tmp;
+            // Look for a free block where the lowest part of it is below the limit,
+            // the limit matters more than the migrate type the block comes from
+            for (uint8_t curr_order = order; curr_order < FRAME_ORDERS; ++curr_order) {
+                for (uint8_t migrate_type = 0; migrate_type < MIGRATE_TYPES; ++migrate_type) {
+                    uint64_t frame = g_free_lists[curr_order].heads[node][zone][migrate_type];
+                    while (frame != FRAME_NONE && frame + (1ULL << order) > limit_frame) {
+                        frame = g_frame_descriptors[frame].next;
+                    }
+
+                    if (frame != FRAME_NONE) {
+                        *out_frame = take_free_block(frame, curr_order, order);
+                        return true;
+                    }
+                }
             }
+        }
+    }
+
+    return false;
+}
+
+// Frees a block and merges it with its buddy as far up as possible
+void free_block(uint64_t frame, uint8_t order) {
+    KERNEL_ASSERT(order < FRAME_ORDERS, "Not an order")
+
+    // Toogle buddy bit to mark block as freed
+    toggle_buddy_bit(frame, order);
 
-            free_memory_entry((MemoryEntry*)buddy_entry);
+    // Merge blocks as far up as possible
+    while (order < (FRAME_ORDERS - 1) && !get_buddy_bit(frame, order)) {
+        const uint64_t buddy_frame = frame ^ (1ULL << order);
 
-            // Put entry in free list
-            entry->next = g_free_lists[order + 1].head;
-            g_free_lists[order + 1].head = entry;
+        // Blocks from different nodes are never merged, both stay free in their own node
+        if (g_frame_descriptors[buddy_frame].node != g_frame_descriptors[frame].node) break;
 
-            // Toogle buddy bit to mark block as freed
-            toggle_buddy_bit(entry->addr, order + 1);
+        // The buddy block should always be free or something has gone terribly wrong
+        KERNEL_ASSERT(is_free_block(buddy_frame, order), "Buddy block not free")
 
-            ++order;
+        remove_free_block(buddy_frame);
+        ++g_frame_stats.merges;
+
+        // The merged block starts at the left buddy
+        frame &= ~(1ULL << order);
+        ++order;
+
+        // Toogle buddy bit to mark merged block as freed
+        toggle_buddy_bit(frame, order);
+    }
+
+    push_free_block(frame, order);
+}
+
+// Moves up to FRAME_CACHE_BATCH frames from the free lists to the frame cache for migrate_type
+void refill_frame_cache(FrameCache* cache, uint8_t migrate_type) {
+    for (uint64_t i = 0; i < FRAME_CACHE_BATCH; ++i) {
+        uint64_t frame;
+        if (!alloc_block(0, migrate_type, &frame)) return;
+
+        cache->frames[(cache->front + cache->count) % FRAME_CACHE_SIZE] = frame;
+        ++cache->count;
+    }
+}
+
+// Moves up to count frames from the back of the frame cache to the free lists
+void drain_frame_cache(FrameCache* cache, uint64_t count) {
+    for (; count != 0 && cache->count != 0; --count) {
+        --cache->count;
+        free_block(cache->frames[(cache->front + cache->count) % FRAME_CACHE_SIZE], 0);
+    }
+}
+
+// Takes a frame from the frame cache, refilling it from the free lists if it's empty
+bool alloc_cached_frame(uint8_t migrate_type, PhysicalAddress* out_addr) {
+    FrameCache* cache = &g_frame_caches[get_cpu_index()][migrate_type];
+    if (cache->count == 0) {
+        refill_frame_cache(cache, migrate_type);
+        if (cache->count == 0) return false;
+    }
+
+    *out_addr = cache->frames[cache->front] * PAGE_SIZE;
+    cache->front = (cache->front + 1) % FRAME_CACHE_SIZE;
+    --cache->count;
+    return true;
+}
+
+// Puts a frame in the frame cache for the migrate type of its pageblock,
+// returning cold frames to the free lists if it's full
+void free_cached_frame(PhysicalAddress addr, bool cold) {
+    FrameCache* cache = &g_frame_caches[get_cpu_index()][get_pageblock_type(addr / PAGE_SIZE)];
+    if (cache->count == FRAME_CACHE_SIZE) drain_frame_cache(cache, FRAME_CACHE_BATCH);
+
+    if (cold) {
+        cache->frames[(cache->front + cache->count) % FRAME_CACHE_SIZE] = addr / PAGE_SIZE;
+    }
+    else {
+        cache->front = (cache->front + FRAME_CACHE_SIZE - 1) % FRAME_CACHE_SIZE;
+        cache->frames[cache->front] = addr / PAGE_SIZE;
+    }
+    ++cache->count;
+}
+
+// Sets the NUMA node of the frames in [start, end), frames outside of all SRAT ranges
+// stay in node 0
+void set_frame_nodes(uint64_t start, uint64_t end) {
+    if (g_node_count == 1) return;
+
+    for (uint64_t i = 0; i < get_numa_memory_range_count(); ++i) {
+        const NUMAMemoryRange* range = get_numa_memory_range(i);
+        const uint64_t range_start = MAX(range->base / PAGE_SIZE, start);
+        const uint64_t range_end = MIN((range->base + range->size) / PAGE_SIZE, end);
+
+        for (uint64_t frame = range_start; frame < range_end; ++frame) {
+            g_frame_descriptors[frame].node = range->node;
         }
     }
 }
 
-bool alloc_frames_contiguos(uint64_t pages, PhysicalAddress* out_addr) {
-    const uint8_t order_to_alloc = get_min_size_frame_order(pages);
-    KERNEL_ASSERT(order_to_alloc < FRAME_ORDERS, "Not an order")
+// Moves next to the deferred pageblock with the lowest address, there has to be one
+void find_next_deferred_pageblock() {
+    while (g_pageblock_types[g_deferred_pageblocks.next] != PAGEBLOCK_DEFERRED) {
+        ++g_deferred_pageblocks.next;
+    }
+}
 
-    // Split bigger blocks if none of the correct size are available
-    {
-        int8_t order = order_to_alloc + 1;
-        while (g_free_lists[order_to_alloc].head == 0) {
-            if (g_free_lists[order].head == 0) {
-                // Out of memory
-                if (++order >= FRAME_ORDERS) return false;
-            }
+// Puts the next deferred pageblock in the free lists
+// Returns false if there is no deferred memory left
+bool populate_deferred_pageblock() {
+    if (g_deferred_pageblocks.count == 0) return false;
+
+    find_next_deferred_pageblock();
+    const uint64_t frame = g_deferred_pageblocks.next << PAGEBLOCK_ORDER;
+    memset(&g_frame_descriptors[frame], 0, sizeof(FrameDescriptor) << PAGEBLOCK_ORDER);
+    set_frame_nodes(frame, frame + (1ULL << PAGEBLOCK_ORDER));
 
-            // Remove entyr from free list
-            ListEntry* entry = g_free_lists[order].head;
-            g_free_lists[order].head = entry->next;
+    g_pageblock_types[g_deferred_pageblocks.next] = MIGRATE_MOVABLE;
+    --g_deferred_pageblocks.count;
 
-            split_entry(entry, order);
+    // Free the pageblock as blocks which don't cross NUMA nodes
+    for (uint64_t curr = frame; curr < frame + (1ULL << PAGEBLOCK_ORDER);) {
+        const uint8_t order = get_range_block_order(curr, frame + (1ULL << PAGEBLOCK_ORDER) - curr);
+        free_block(curr, order);
+        curr += 1ULL << order;
+    }
+
+    return true;
+}
+
+// Populates up to count deferred pageblocks
+// Returns false if there was no deferred memory left
+bool populate_deferred_pageblocks(uint64_t count) {
+    if (!populate_deferred_pageblock()) return false;
+
+    while (--count != 0 && populate_deferred_pageblock()) continue;
+    return true;
+}
+
+// Populates up to count deferred pageblocks which start below limit_frame
+// Returns false if there was no deferred memory left below the limit
+bool populate_deferred_pageblocks_below(uint64_t count, uint64_t limit_frame) {
+    uint64_t populated = 0;
+    while (populated < count && g_deferred_pageblocks.count != 0) {
+        // Pageblocks are populated in address order, so the next one is the lowest
+        find_next_deferred_pageblock();
+        if ((g_deferred_pageblocks.next << PAGEBLOCK_ORDER) >= limit_frame) break;
+
+        populate_deferred_pageblock();
+        ++populated;
+    }
+
+    return populated != 0;
+}
+
+bool populate_deferred_memory() {
+    // The allocator is only touched with interrupts disabled
+    const uint64_t rflags = disable_interrupts();
+    const bool populated = populate_deferred_pageblock();
+    restore_interrupts(rflags);
+
+    return populated;
+}
 
-            --order;
+// Allocates an unmovable block of the specified order which ends at or below limit_frame,
+// deferred memory below the limit is populated before giving up like in alloc_order
+bool alloc_block_below(uint8_t order, uint64_t limit_frame, uint64_t* out_frame) {
+    const uint64_t pageblocks = order > PAGEBLOCK_ORDER ? 1ULL << (order - PAGEBLOCK_ORDER) : 1;
+    do {
+        if (take_block_below(order, limit_frame, out_frame)) return true;
+    } while (populate_deferred_pageblocks_below(pageblocks, limit_frame));
+
+    return false;
+}
+
+// Allocates a block of the specified order, single frames are taken from the frame cache
+bool alloc_order(uint8_t order, uint8_t migrate_type, uint64_t* out_frame) {
+    // Deferred memory is populated when everything else has been used up,
+    // enough pageblocks for a block of order at a time
+    const uint64_t pageblocks = order > PAGEBLOCK_ORDER ? 1ULL << (order - PAGEBLOCK_ORDER) : 1;
+    do {
+        // The frame cache can contain frames from any node
+        if (order != 0 || g_frame_policies[get_cpu_index()].mode == FRAME_POLICY_BIND) {
+            if (alloc_block(order, migrate_type, out_frame)) return true;
+            continue;
+        }
+
+        PhysicalAddress addr;
+        if (alloc_cached_frame(migrate_type, &addr)) {
+            *out_frame = addr / PAGE_SIZE;
+            return true;
         }
+    } while (populate_deferred_pageblocks(pageblocks));
+
+    return false;
+}
+
+bool alloc_frame(PhysicalAddress* out_addr) {
+    ++g_frame_stats.allocations;
+
+    uint64_t frame;
+    if (!alloc_order(0, MIGRATE_UNMOVABLE, &frame)) return false;
+
+    *out_addr = frame * PAGE_SIZE;
+    return true;
+}
+
+void free_frame(PhysicalAddress addr, bool cold) {
+    ++g_frame_stats.frees;
+    free_cached_frame(addr, cold);
+}
+
+void drain_frame_caches() {
+    for (uint8_t migrate_type = 0; migrate_type < MIGRATE_TYPES; ++migrate_type) {
+        drain_frame_cache(&g_frame_caches[get_cpu_index()][migrate_type], FRAME_CACHE_SIZE);
     }
+}
 
-    ListEntry* entry = g_free_lists[order_to_alloc].head;
+// Takes a frame from the zeroed frame pool of the migrate type
+bool take_zeroed_frame(uint8_t migrate_type, uint64_t* out_frame) {
+    // The pool can contain frames from any node
+    if (g_zeroed_frames[migrate_type].count == 0 ||
+        g_frame_policies[get_cpu_index()].mode == FRAME_POLICY_BIND) {
+        return false;
+    }
 
-    // Remove block from free list
-    g_free_lists[order_to_alloc].head = entry->next;
+    *out_frame = g_zeroed_frames[migrate_type].head;
+    g_zeroed_frames[migrate_type].head = g_frame_descriptors[*out_frame].next;
+    --g_zeroed_frames[migrate_type].count;
+    return true;
+}
 
-    // Mark block as allocated
-    toggle_buddy_bit(entry->addr, order_to_alloc);
+bool alloc_zeroed_frame(PhysicalAddress* out_addr) {
+    ++g_frame_stats.allocations;
 
-    *out_addr = entry->addr;
+    uint64_t frame;
+    if (take_zeroed_frame(MIGRATE_UNMOVABLE, &frame)) {
+        *out_addr = frame * PAGE_SIZE;
+        return true;
+    }
 
-    free_memory_entry((MemoryEntry*)entry);
+    if (!alloc_order(0, MIGRATE_UNMOVABLE, &frame)) return false;
 
+    *out_addr = frame * PAGE_SIZE;
+    kzero_phys_range(*out_addr, 1);
     return true;
 }
 
-void free_frames_contiguos(PhysicalAddress addr, uint64_t pages) {
-    PageFrameAllocation* allocation = (PageFrameAllocation*)get_memory_entry();
-    allocation->addr = addr;
-    allocation->order = get_min_size_frame_order(pages);
+// Gets the number of frames the zeroed frame pool of the migrate type is below its target
+uint64_t get_missing_zeroed_frames(uint8_t migrate_type) {
+    const uint64_t target = c_zeroed_frame_targets[migrate_type];
+    return target - MIN(g_zeroed_frames[migrate_type].count, target);
+}
+
+bool refill_zeroed_frames() {
+    // The pool missing the most frames is filled first
+    uint8_t migrate_type = 0;
+    for (uint8_t i = 1; i < MIGRATE_TYPES; ++i) {
+        if (get_missing_zeroed_frames(i) > get_missing_zeroed_frames(migrate_type)) {
+            migrate_type = i;
+        }
+    }
+
+    if (get_missing_zeroed_frames(migrate_type) == 0) return false;
+
+    // The allocator is only touched with interrupts disabled,
+    // the frame is cleared through the direct map with the interrupt flag of the caller
+    uint64_t rflags = disable_interrupts();
+
+    // Taken straight from the free lists to leave the cache hot frames in the frame cache,
+    // from pageblocks of the migrate type the pool serves
+    uint64_t frame;
+    if (!alloc_block(0, migrate_type, &frame)) {
+        restore_interrupts(rflags);
+        return false;
+    }
+
+    restore_interrupts(rflags);
+
+    memset((void*)PHYS_TO_DIRECT_MAP(frame * PAGE_SIZE), 0, PAGE_SIZE);
 
-    free_frames(allocation);
+    rflags = disable_interrupts();
+
+    g_frame_descriptors[frame].next = g_zeroed_frames[migrate_type].head;
+    g_zeroed_frames[migrate_type].head = frame;
+    ++g_zeroed_frames[migrate_type].count;
+    restore_interrupts(rflags);
+
+    return true;
 }
 
-// Removes address ranges from free lists
-bool remove_range(PhysicalAddress addr, uint64_t pages) {
-    uint64_t size = pages * PAGE_SIZE;
-    while (size != 0) {
-        // Find largest order size which range fits into
-        int32_t order_to_alloc = 1;
-        while (order_to_alloc < FRAME_ORDERS) {
-            // Address aligns with block size of order
-            const bool addr_align = (addr % g_frame_order_sizes[order_to_alloc]) == 0;
+// Frees a block of the specified order, single frames are put in the frame cache
+void free_order(uint64_t frame, uint8_t order) {
+    if (order == 0) {
+        free_cached_frame(frame * PAGE_SIZE, false);
+    }
+    else {
+        free_block(frame, order);
+    }
+}
+
+// Frees all frames in the range as the largest naturally aligned blocks that fit
+void free_blocks_in_range(uint64_t frame, uint64_t count, bool use_cache) {
+    while (count != 0) {
+        const uint8_t order = get_range_block_order(frame, count);
+
+        if (use_cache) {
+            free_order(frame, order);
+        }
+        else {
+            free_block(frame, order);
+        }
+
+        frame += 1ULL << order;
+        count -= 1ULL << order;
+    }
+}
+
+void free_frame_range(PhysicalAddress addr, uint64_t pages) {
+    ++g_frame_stats.frees;
+    free_blocks_in_range(addr / PAGE_SIZE, pages, true);
+}
+
+// Claims the free block starting at frame, splitting it so that the claimed block
+// is no bigger than max_frames. Returns false if frame isn't the start of a free block
+// in node with the same migrate type.
+bool claim_block_at(uint64_t frame, uint8_t node, uint8_t migrate_type, uint64_t max_frames,
+                    uint8_t* out_order) {
+    if (frame >= g_frame_count) return false;
+
+    uint64_t block;
+    uint8_t order;
+    if (!find_free_block(frame, &block, &order) || block != frame) return false;
+    if (g_frame_descriptors[block].node != node) return false;
+    if (g_frame_descriptors[block].migrate_type != migrate_type) return false;
+
+    while (order > 0 && (1ULL << order) > max_frames) --order;
+
+    *out_order = order;
+    take_free_block(block, g_frame_descriptors[block].order, order);
+    return true;
+}
+
+// Adds a block to the back of an allocation list
+void append_allocation(uint64_t frame, uint8_t order, PageFrameAllocation** front,
+                       PageFrameAllocation** back) {
+    PageFrameAllocation* allocation = alloc_pool_entry(ENTRY_POOL_FRAME_ALLOCATIONS);
+    allocation->addr = frame * PAGE_SIZE;
+    allocation->order = order;
+    allocation->next = 0;
+
+    if (*front == 0) {
+        *front = allocation;
+    }
+    else {
+        (*back)->next = allocation;
+    }
+    *back = allocation;
+}
+
+// Tries to allocate the whole request as one physical run
+PageFrameAllocation* alloc_frames_single_run(uint64_t pages, uint8_t migrate_type) {
+    const uint8_t order_to_alloc = get_min_size_frame_order(pages);
+    if (order_to_alloc >= FRAME_ORDERS) return 0;
+
+    uint64_t frame;
+    if (!alloc_order(order_to_alloc, migrate_type, &frame)) return 0;
 
-            // Size big enough for order
-            const bool big_enough = size >= g_frame_order_sizes[order_to_alloc];
+    // Give back the part of the block which wasn't requested
+    free_blocks_in_range(frame + pages, (1ULL << order_to_alloc) - pages, false);
 
-            if (!addr_align || !big_enough) break;
+    // The run is described by naturally aligned blocks
+    PageFrameAllocation* front = 0;
+    PageFrameAllocation* back = 0;
+    while (pages != 0) {
+        const uint8_t order = get_range_block_order(frame, pages);
+        append_allocation(frame, order, &front, &back);
+        frame += 1ULL << order;
+        pages -= 1ULL << order;
+    }
+
+    return front;
+}
 
-            ++order_to_alloc;
+// Takes all frames for an allocation from the zeroed frame pool of the migrate type
+PageFrameAllocation* alloc_zeroed_pool_frames(uint64_t pages, uint8_t migrate_type) {
+    PageFrameAllocation* front = 0;
+    PageFrameAllocation* back = 0;
+    for (uint64_t i = 0; i < pages; ++i) {
+        uint64_t frame;
+        if (!take_zeroed_frame(migrate_type, &frame)) {
+            free_frames(front);
+            return 0;
         }
-        --order_to_alloc;
 
-        for (int32_t order = FRAME_ORDERS - 1; order >= 0; --order) {
-            // Look for entry which contains addr in its range
-            ListEntry* curr_entry = g_free_lists[order].head;
-            ListEntry* last_entry = 0;
-            while (curr_entry != 0 &&
-                   !range_contains(addr, curr_entry->addr, g_frame_order_sizes[order])) {
-                last_entry = curr_entry;
-                curr_entry = curr_entry->next;
-            }
+        append_allocation(frame, 0, &front, &back);
+    }
 
-            // Entry for address not found in current order free list
-            if (curr_entry == 0) {
-                // Requested block not available
-                if (order == order_to_alloc) return false;
+    return front;
+}
 
-                continue;
-            }
+// Clears all frames in allocation list
+void zero_allocation(PageFrameAllocation* allocation) {
+    while (allocation != 0) {
+        const PhysicalAddress phys_addr = allocation->addr;
+        uint64_t pages;
+        allocation = get_allocation_run(allocation, &pages);
+        kzero_phys_range(phys_addr, pages);
+    }
+}
 
-            // Remove entry from free list
-            if (curr_entry == g_free_lists[order].head) {
-                g_free_lists[order].head = curr_entry->next;
-            }
-            else {
-                last_entry->next = curr_entry->next;
-            }
+PageFrameAllocation* alloc_frames(uint64_t pages, FrameFlags flags) {
+    ++g_frame_stats.allocations;
+
+    const bool contiguous = (flags & FRAME_CONTIGUOUS) != 0;
+    const bool zeroed = (flags & FRAME_ZEROED) != 0;
+    const uint8_t migrate_type = get_flags_migrate_type(flags);
+
+    // The zeroed frame pools only have single frames so they can't be used when contiguity
+    // matters, every migrate type takes frames from its own pool
+    if (zeroed && (!contiguous || pages == 1) && pages <= g_zeroed_frames[migrate_type].count) {
+        PageFrameAllocation* allocation = alloc_zeroed_pool_frames(pages, migrate_type);
+        if (allocation != 0) return allocation;
+    }
+
+    if (contiguous) {
+        PageFrameAllocation* allocation = alloc_frames_single_run(pages, migrate_type);
+        if (allocation != 0) {
+            if (zeroed) zero_allocation(allocation);
+            return allocation;
+        }
+    }
+
+    uint64_t size = pages * PAGE_SIZE;
 
-            // Remove entry from free list
-            if (order == order_to_alloc) {
-                // Toogle buddy bit to mark block as allocated
-                toggle_buddy_bit(curr_entry->addr, order);
+    // Allocation list which will be returned to caller
+    PageFrameAllocation* front = 0;
+    PageFrameAllocation* back = 0;
 
-                free_memory_entry((MemoryEntry*)curr_entry);
-                break;
+    // Loop until enough memory has been allocated
+    while (size != 0) {
+        uint64_t frame;
+        int8_t order_to_alloc;
+
+        // Extend the current run with the free block right after it if there is one
+        uint8_t claimed_order;
+        if (contiguous && back != 0 &&
+            claim_block_at(back->addr / PAGE_SIZE + (1ULL << back->order),
+                           g_frame_descriptors[back->addr / PAGE_SIZE].node,
+                           migrate_type,
+                           size / PAGE_SIZE,
+                           &claimed_order)) {
+            frame = back->addr / PAGE_SIZE + (1ULL << back->order);
+            order_to_alloc = claimed_order;
+        }
+        else {
+            // Get biggest order which fits into allocations size
+            order_to_alloc = FRAME_ORDERS - 1;
+            while (order_to_alloc > 0 && size < g_frame_order_sizes[order_to_alloc]) {
+                --order_to_alloc;
             }
-            // Split entry into two entries one order lower
-            else {
-                KERNEL_ASSERT(order != 0, "Can't split order 0 block")
-                split_entry(curr_entry, order);
+
+            // Split bigger blocks if none of the correct size are available
+            // or create allocation from smaller blocks
+            while (!alloc_order(order_to_alloc, migrate_type, &frame)) {
+                // Cleanup allocation if we are out of memory
+                if (--order_to_alloc < 0) {
+                    free_frames(front);
+                    return 0;
+                }
             }
         }
 
+        // Add allocation to allocation list
+        append_allocation(frame, order_to_alloc, &front, &back);
+
         size -= g_frame_order_sizes[order_to_alloc];
-        addr += g_frame_order_sizes[order_to_alloc];
     }
 
+    if (zeroed) zero_allocation(front);
+    return front;
+}
+
+void free_frames(PageFrameAllocation* allocation) {
+    ++g_frame_stats.frees;
+
+    // Loop until all allocations have been freed
+    while (allocation != 0) {
+        free_order(allocation->addr / PAGE_SIZE, allocation->order);
+
+        PageFrameAllocation* next = allocation->next;
+        free_pool_entry(ENTRY_POOL_FRAME_ALLOCATIONS, allocation);
+        allocation = next;
+    }
+}
+
+bool get_dma_region_bit(uint64_t index) {
+    return (g_dma_region.bitmap[index / 64] >> (index % 64)) & 1;
+}
+
+void set_dma_region_bits(uint64_t index, uint64_t count, bool value) {
+    for (uint64_t i = index; i < index + count; ++i) {
+        if (value) {
+            g_dma_region.bitmap[i / 64] |= 1ULL << (i % 64);
+        }
+        else {
+            g_dma_region.bitmap[i / 64] &= ~(1ULL << (i % 64));
+        }
+    }
+}
+
+// Allocates frames from the DMA region using first fit
+bool alloc_dma_region_frames(uint64_t count, uint64_t align_frames, uint64_t limit_frame,
+                             uint64_t* out_frame) {
+    uint64_t start = round_up_to_multiple(g_dma_region.frame, align_frames) - g_dma_region.frame;
+    for (; start + count <= g_dma_region.count; start += align_frames) {
+        if (g_dma_region.frame + start + count > limit_frame) return false;
+
+        uint64_t i = start;
+        while (i < start + count && !get_dma_region_bit(i)) ++i;
+
+        if (i == start + count) {
+            set_dma_region_bits(start, count, true);
+            *out_frame = g_dma_region.frame + start;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool alloc_frames_constrained(uint64_t pages, PhysicalAddress max_addr, uint64_t align,
+                              PhysicalAddress* out_addr) {
+    ++g_frame_stats.allocations;
+
+    KERNEL_ASSERT(pages != 0, "Can't have a zero sized allocation")
+    KERNEL_ASSERT(align >= PAGE_SIZE && (align & (align - 1)) == 0,
+                  "Alignment has to be a power of two and at least a page")
+
+    const uint64_t align_frames = align / PAGE_SIZE;
+    const uint64_t limit_frame = max_addr / PAGE_SIZE + 1;
+
+    // Blocks are aligned to their size so the alignment is met by allocating a big enough block
+    const uint8_t order_to_alloc =
+        MAX(get_min_size_frame_order(pages), get_min_size_frame_order(align_frames));
+
+    uint64_t frame;
+    if (order_to_alloc < FRAME_ORDERS) {
+        bool success = limit_frame >= g_frame_count
+                           ? alloc_order(order_to_alloc, MIGRATE_UNMOVABLE, &frame)
+                           : alloc_block_below(order_to_alloc, limit_frame, &frame);
+        if (!success) {
+            // Cached frames might be holding back buddies which would merge into a big enough block
+            drain_frame_caches();
+            success = alloc_block_below(order_to_alloc, limit_frame, &frame);
+        }
+
+        if (success) {
+            // Give back the part of the block which wasn't requested
+            free_blocks_in_range(frame + pages, (1ULL << order_to_alloc) - pages, false);
+
+            *out_addr = frame * PAGE_SIZE;
+            return true;
+        }
+    }
+
+    if (!alloc_dma_region_frames(pages, align_frames, limit_frame, &frame)) return false;
+
+    *out_addr = frame * PAGE_SIZE;
     return true;
 }
 
+bool alloc_frames_contiguos(uint64_t pages, PhysicalAddress* out_addr) {
+    return alloc_frames_constrained(pages, UINT64_MAX, PAGE_SIZE, out_addr);
+}
+
+void free_frames_contiguos(PhysicalAddress addr, uint64_t pages) {
+    ++g_frame_stats.frees;
+
+    const uint64_t frame = addr / PAGE_SIZE;
+    if (range_contains(frame, g_dma_region.frame, g_dma_region.count)) {
+        KERNEL_ASSERT(frame + pages <= g_dma_region.frame + g_dma_region.count,
+                      "Allocation does not fit in DMA region")
+        set_dma_region_bits(frame - g_dma_region.frame, pages, false);
+        return;
+    }
+
+    free_blocks_in_range(frame, pages, true);
+}
+
+// Checks if memory of a UEFI memory type is managed by the frame allocator,
+// either from initialization or from when UEFI memory is freed
+bool is_frame_allocator_memory(uint32_t type) {
+    switch (type) {
+        case EfiConventionalMemory:
+        case EfiBootServicesCode:
+        case EfiBootServicesData:
+        case EfiRuntimeServicesCode:
+        case EfiRuntimeServicesData:
+        case EfiLoaderData: return true;
+        default: return false;
+    }
+}
+
+uint64_t get_pageblock_count() {
+    return (g_frame_count + (1ULL << PAGEBLOCK_ORDER) - 1) >> PAGEBLOCK_ORDER;
+}
+
 void alloc_frame_allocator_memory(void* uefi_memory_map, PhysicalAddress* phys_addr,
                                   uint64_t* total_pages, uint64_t* entry_pool_pages) {
     // Calculate block sizes
@@ -388,31 +1203,52 @@ void alloc_frame_allocator_memory(void* uefi_memory_map, PhysicalAddress* phys_a
         g_frame_order_sizes[i] = g_frame_order_sizes[i - 1] * 2;
     }
 
-    // Calculate size required by bitmaps
+    const UEFIMemoryMap* memory_map = (UEFIMemoryMap*)uefi_memory_map;
+
+    // Metadata only has to cover memory the allocator will hand out,
+    // memory mapped IO at the top of the address space and holes are left out
+    uint64_t usable_pages = 0;
+    for (uint64_t i = 0; i < memory_map->buffer_size; i += memory_map->desc_size) {
+        const UEFIMemoryDescriptor* desc = (UEFIMemoryDescriptor*)&memory_map->buffer[i];
+        if (!is_frame_allocator_memory(desc->type)) continue;
+
+        usable_pages += desc->num_pages;
+        g_frame_count =
+            MAX(g_frame_count, desc->physical_start / PAGE_SIZE + desc->num_pages);
+    }
+    KERNEL_ASSERT(g_frame_count < FRAME_NONE, "Too many frames for frame descriptors")
+
+    // Calculate size required by bitmaps, frame descriptors and pageblock types
     uint64_t total_bitmaps_size = 0;
+    uint64_t descriptors_size = 0;
+    uint64_t pageblock_types_size = 0;
     {
-        // List entries required at start by all max order blocks
-        // We double the amount of free list entries required at the start
-        const uint64_t free_list_entries =
-            (get_memory_size() / g_frame_order_sizes[FRAME_ORDERS - 1]) * 2;
+        // Memory entries reserved at start for allocation lists and address space free lists
+        const uint64_t initial_entries =
+            (usable_pages * PAGE_SIZE / g_frame_order_sizes[FRAME_ORDERS - 1]) * 2;
 
         *entry_pool_pages =
-            round_up_to_multiple(free_list_entries * sizeof(ListEntry), PAGE_SIZE) / PAGE_SIZE;
+            round_up_to_multiple(initial_entries * ENTRY_SIZE, PAGE_SIZE) / PAGE_SIZE;
 
         // Calculate memory required by bitmaps
-        for (int i = 0; i < (FRAME_ORDERS - 1); ++i) {
-            total_bitmaps_size += get_memory_size() / g_frame_order_sizes[i];
-        }
+        for (int i = 0; i < (FRAME_ORDERS - 1); ++i) total_bitmaps_size += get_buddy_map_size(i);
 
         total_bitmaps_size = round_up_to_multiple(total_bitmaps_size, PAGE_SIZE) / PAGE_SIZE;
+
+        descriptors_size =
+            round_up_to_multiple(g_frame_count * sizeof(FrameDescriptor), PAGE_SIZE) / PAGE_SIZE;
+
+        pageblock_types_size =
+            round_up_to_multiple(get_pageblock_count(), PAGE_SIZE) / PAGE_SIZE;
     }
 
-    // The total pages to allocate for the entry pool and the bitmaps
-    *total_pages = *entry_pool_pages + total_bitmaps_size;
+    // The total pages to allocate for the entry pool, the bitmaps, the frame descriptors
+    // and the pageblock types
+    *total_pages = *entry_pool_pages + total_bitmaps_size + descriptors_size + pageblock_types_size;
+    g_frame_allocator_metadata_pages = *total_pages;
 
     // Allocate memory for free lists and bitmaps
     *phys_addr = 0;
-    const UEFIMemoryMap* memory_map = (UEFIMemoryMap*)uefi_memory_map;
     for (uint64_t i = 0; i < memory_map->buffer_size; i += memory_map->desc_size) {
         UEFIMemoryDescriptor* desc = (UEFIMemoryDescriptor*)&memory_map->buffer[i];
 
@@ -432,89 +1268,460 @@ void alloc_frame_allocator_memory(void* uefi_memory_map, PhysicalAddress* phys_a
 
         desc->num_pages -= *total_pages;
         desc->physical_start += *total_pages * PAGE_SIZE;
-        KERNEL_ASSERT(phys_addr != 0, "Not enough memory for frame allocator")
-        return;
+        break;
+    }
+    KERNEL_ASSERT(*phys_addr != 0, "Not enough memory for frame allocator")
+
+    // Reserve the DMA region, the memory is cut out of the memory map so it never enters the
+    // free lists. Machines without a big enough range below 4GiB go without one.
+    for (uint64_t i = 0; i < memory_map->buffer_size; i += memory_map->desc_size) {
+        UEFIMemoryDescriptor* desc = (UEFIMemoryDescriptor*)&memory_map->buffer[i];
+
+        if (desc->type != EfiConventionalMemory) continue;
+
+        // Skip memory before 1MB
+        if (desc->physical_start < 0x100000) continue;
+
+        if (desc->num_pages < DMA_REGION_FRAMES) continue;
+
+        if (desc->physical_start + DMA_REGION_FRAMES * PAGE_SIZE > DMA_REGION_MAX_ADDR) continue;
+
+        g_dma_region.frame = desc->physical_start / PAGE_SIZE;
+        g_dma_region.count = DMA_REGION_FRAMES;
+
+        desc->num_pages -= DMA_REGION_FRAMES;
+        desc->physical_start += DMA_REGION_FRAMES * PAGE_SIZE;
+        break;
+    }
+}
+
+// Frees a usable range of memory at initialization, the pageblocks entirely inside it
+// start out movable
+void free_initial_range(uint64_t frame, uint64_t count) {
+    const uint64_t first = (frame + (1ULL << PAGEBLOCK_ORDER) - 1) >> PAGEBLOCK_ORDER;
+    const uint64_t last = (frame + count) >> PAGEBLOCK_ORDER;
+    for (uint64_t pageblock = first; pageblock < last; ++pageblock) {
+        g_pageblock_types[pageblock] = MIGRATE_MOVABLE;
+    }
+
+    free_blocks_in_range(frame, count, false);
+}
+
+// Gets the next range of memory which is free at initialization, the memory map has been sorted
+// so adjacent usable descriptors are merged into one range
+// index is the offset of the memory map descriptor to continue from
+bool next_initial_range(const UEFIMemoryMap* memory_map, uint64_t* index, uint64_t* out_frame,
+                        uint64_t* out_count) {
+    *out_count = 0;
+    for (; *index < memory_map->buffer_size; *index += memory_map->desc_size) {
+        const UEFIMemoryDescriptor* desc = (UEFIMemoryDescriptor*)&memory_map->buffer[*index];
+
+        // Other memory types are either unusable or have memory that is currently being used
+        const bool correct_type = desc->type == EfiConventionalMemory ||
+                                  desc->type == EfiRuntimeServicesCode ||
+                                  desc->type == EfiBootServicesCode;
+
+        if (!correct_type || desc->num_pages == 0) continue;
+
+        KERNEL_ASSERT((desc->physical_start % PAGE_SIZE) == 0, "Address not page aligned")
+
+        const uint64_t frame = desc->physical_start / PAGE_SIZE;
+        if (*out_count != 0 && frame != *out_frame + *out_count) break;
+
+        if (*out_count == 0) *out_frame = frame;
+        *out_count += desc->num_pages;
     }
+
+    return *out_count != 0;
+}
+
+// Frees the parts of a usable range which aren't deferred
+void free_populated_range(uint64_t frame, uint64_t count) {
+    const uint64_t end = frame + count;
+
+    uint64_t run_start = frame;
+    for (uint64_t curr = frame; curr < end;) {
+        const uint64_t next = MIN((curr | ((1ULL << PAGEBLOCK_ORDER) - 1)) + 1, end);
+
+        // Deferred pageblocks are always entire pageblocks
+        if (g_pageblock_types[curr >> PAGEBLOCK_ORDER] == PAGEBLOCK_DEFERRED) {
+            free_initial_range(run_start, curr - run_start);
+            run_start = next;
+        }
+
+        curr = next;
+    }
+
+    free_initial_range(run_start, end - run_start);
 }
 
 void initialize_frame_allocator(VirtualAddress virt_addr, uint64_t total_pages,
                                 void* uefi_memory_map, uint64_t entry_pool_pages) {
-    _Static_assert(sizeof(ListEntry) == 16, "Size of ListEntry is not 16 bytes");
     _Static_assert(sizeof(PageFrameAllocation) == 16,
                    "Size of PageFrameAllocation is not 16 bytes");
 
-    // Zero out memory used for allocator
-    memset((void*)virt_addr, 0, total_pages * PAGE_SIZE);
+    const uint64_t start_cycles = read_timestamp_counter();
+
+    const UEFIMemoryMap* memory_map = (UEFIMemoryMap*)uefi_memory_map;
+    const VirtualAddress metadata_end = virt_addr + total_pages * PAGE_SIZE;
 
-    // Populate entry pool and buddy maps
+    // Populate entry pool, buddy maps and pageblock types, which are small compared to memory.
+    // The frame descriptors are cleared once it's known which memory is deferred.
     {
+        memset((void*)virt_addr, 0, entry_pool_pages * PAGE_SIZE);
         fill_memory_entry_pool(virt_addr, entry_pool_pages);
         virt_addr += entry_pool_pages * PAGE_SIZE;
 
         // Populate buddy maps
+        const VirtualAddress buddy_maps_addr = virt_addr;
         for (uint64_t i = 0; i < (FRAME_ORDERS - 1); ++i) {
             g_free_lists[i].buddy_map = (uint64_t*)virt_addr;
-            virt_addr += get_memory_size() / g_frame_order_sizes[i];
+            virt_addr += get_buddy_map_size(i);
         }
+        memset((void*)buddy_maps_addr, 0, virt_addr - buddy_maps_addr);
+
+        g_frame_descriptors = (FrameDescriptor*)round_up_to_multiple(virt_addr, PAGE_SIZE);
+
+        // Pageblocks which aren't entirely free memory stay unmovable (zero),
+        // so the frames compaction moves are always frames the allocator manages
+        g_pageblock_types =
+            (uint8_t*)g_frame_descriptors +
+            round_up_to_multiple(g_frame_count * sizeof(FrameDescriptor), PAGE_SIZE);
+        memset(g_pageblock_types, 0, metadata_end - (VirtualAddress)g_pageblock_types);
     }
 
-    // Populate free lists with max order sized blocks
-    {
-        PhysicalAddress curr_addr = 0;
+    for (uint64_t i = 0; i < FRAME_ORDERS; ++i) {
+        for (uint64_t node = 0; node < MAX_NUMA_NODES; ++node) {
+            for (uint64_t zone = 0; zone < ZONE_COUNT; ++zone) {
+                for (uint64_t migrate_type = 0; migrate_type < MIGRATE_TYPES; ++migrate_type) {
+                    g_free_lists[i].heads[node][zone][migrate_type] = FRAME_NONE;
+                }
+            }
+        }
+    }
 
-        // Add first entry to free list
-        ListEntry* curr_entry = (ListEntry*)get_memory_entry();
-        curr_entry->addr = curr_addr;
-        curr_addr += g_frame_order_sizes[FRAME_ORDERS - 1];
-        g_free_lists[FRAME_ORDERS - 1].head = curr_entry;
+    // Defer the pageblocks after the first INITIAL_POPULATED_FRAMES of free memory,
+    // low memory is populated first so the DMA32 zone is available right away
+    {
+        uint64_t populated_frames = 0;
+        uint64_t index = 0;
+        uint64_t frame;
+        uint64_t count;
+        while (next_initial_range(memory_map, &index, &frame, &count)) {
+            // The populated part of the range ends at a pageblock boundary
+            uint64_t deferred_frame = frame;
+            if (populated_frames < INITIAL_POPULATED_FRAMES) {
+                const uint64_t populated_end = frame + INITIAL_POPULATED_FRAMES - populated_frames;
+                deferred_frame = MIN(round_up_to_multiple(populated_end, 1ULL << PAGEBLOCK_ORDER),
+                                     frame + count);
+                populated_frames += deferred_frame - frame;
+            }
 
-        const uint64_t block_count = get_memory_size() / g_frame_order_sizes[FRAME_ORDERS - 1];
-        for (uint64_t i = 1; i < block_count; ++i) {
-            if (curr_addr >= get_memory_size()) break;
+            // Only entire pageblocks are deferred
+            const uint64_t first =
+                round_up_to_multiple(deferred_frame, 1ULL << PAGEBLOCK_ORDER) >> PAGEBLOCK_ORDER;
+            const uint64_t last = (frame + count) >> PAGEBLOCK_ORDER;
+            for (uint64_t pageblock = first; pageblock < last; ++pageblock) {
+                g_pageblock_types[pageblock] = PAGEBLOCK_DEFERRED;
+                ++g_deferred_pageblocks.count;
+            }
+        }
+    }
 
-            ListEntry* next_entry = (ListEntry*)get_memory_entry();
-            next_entry->addr = curr_addr;
-            curr_addr += g_frame_order_sizes[FRAME_ORDERS - 1];
+    // Clear the frame descriptors of everything which isn't deferred
+    {
+        uint64_t run_start = 0;
+        for (uint64_t pageblock = 0; pageblock <= get_pageblock_count(); ++pageblock) {
+            const uint64_t frame = MIN(pageblock << PAGEBLOCK_ORDER, g_frame_count);
+            if (pageblock < get_pageblock_count() &&
+                g_pageblock_types[pageblock] != PAGEBLOCK_DEFERRED) {
+                continue;
+            }
 
-            curr_entry->next = next_entry;
-            curr_entry = next_entry;
+            memset(&g_frame_descriptors[run_start],
+                   0,
+                   (frame - run_start) * sizeof(FrameDescriptor));
+            run_start = MIN(frame + (1ULL << PAGEBLOCK_ORDER), g_frame_count);
         }
     }
 
-    // Remove all unusable frames from allocator
+    // Populate free lists directly from the usable ranges of the memory map
     {
-        const UEFIMemoryMap* memory_map = (UEFIMemoryMap*)uefi_memory_map;
-        const UEFIMemoryDescriptor* last = 0;
-        for (uint64_t i = 0; i < memory_map->buffer_size; i += memory_map->desc_size) {
-            const UEFIMemoryDescriptor* desc = (UEFIMemoryDescriptor*)&memory_map->buffer[i];
-
-            // Remove frames not present in the memory map
-            {
-                const PhysicalAddress addr = last->physical_start + last->num_pages * PAGE_SIZE;
-                if (addr != desc->physical_start && last != 0) {
-                    const uint64_t size = desc->physical_start - addr;
-
-                    KERNEL_ASSERT((addr % PAGE_SIZE) == 0, "Address not page aligned")
-                    KERNEL_ASSERT((size % PAGE_SIZE) == 0, "Size not page aligned")
-
-                    const bool success = remove_range(addr, size / PAGE_SIZE);
-                    KERNEL_ASSERT(success, "Failed to remove unusable frames from frame allocator")
-                }
+        uint64_t index = 0;
+        uint64_t frame;
+        uint64_t count;
+        while (next_initial_range(memory_map, &index, &frame, &count)) {
+            free_populated_range(frame, count);
+        }
+    }
+
+    g_frame_allocator_init_cycles = read_timestamp_counter() - start_cycles;
+}
+
+void assign_frame_numa_nodes() {
+    g_node_count = get_numa_node_count();
+    if (g_node_count == 1) return;
+
+    // Order the nodes by distance from every node
+    for (uint8_t from = 0; from < g_node_count; ++from) {
+        uint8_t* fallbacks = g_node_fallbacks[from];
+        for (uint8_t i = 0; i < g_node_count; ++i) {
+            uint8_t j = i;
+            for (; j > 0 && get_numa_distance(from, fallbacks[j - 1]) > get_numa_distance(from, i);
+                 --j) {
+                fallbacks[j] = fallbacks[j - 1];
             }
+            fallbacks[j] = i;
+        }
+    }
+
+    // Deferred pageblocks get their node when they are populated
+    for (uint64_t pageblock = 0; pageblock < get_pageblock_count(); ++pageblock) {
+        if (g_pageblock_types[pageblock] == PAGEBLOCK_DEFERRED) continue;
+
+        const uint64_t frame = pageblock << PAGEBLOCK_ORDER;
+        set_frame_nodes(frame, MIN(frame + (1ULL << PAGEBLOCK_ORDER), g_frame_count));
+    }
+
+    // All free blocks are in the node 0 free lists, move them to the lists of their node.
+    // Blocks with frames from several nodes are split up along the node boundaries.
+    for (uint8_t order = 0; order < FRAME_ORDERS; ++order) {
+        // Blocks are counted again as they are put back
+        g_free_lists[order].count = 0;
+
+        for (uint8_t zone = 0; zone < ZONE_COUNT; ++zone) {
+            for (uint8_t migrate_type = 0; migrate_type < MIGRATE_TYPES; ++migrate_type) {
+                uint64_t frame = g_free_lists[order].heads[0][zone][migrate_type];
+                g_free_lists[order].heads[0][zone][migrate_type] = FRAME_NONE;
+
+                while (frame != FRAME_NONE) {
+                    const uint64_t next = g_frame_descriptors[frame].next;
 
-            // Remove frames of specific memory types
-            switch (desc->type) {
-                case EfiBootServicesCode:
-                case EfiRuntimeServicesCode:
-                case EfiConventionalMemory: break;
-                default: {
-                    const bool success = remove_range(desc->physical_start, desc->num_pages);
-                    KERNEL_ASSERT(success, "Failed to remove unusable frames from frame allocator")
-                    break;
+                    if (!range_crosses_nodes(frame, 1ULL << order)) {
+                        push_free_block(frame, order);
+                    }
+                    else {
+                        // Mark the block as allocated and free it again one node at a time
+                        g_frame_descriptors[frame].flags &= ~FRAME_FREE;
+                        toggle_buddy_bit(frame, order);
+                        free_blocks_in_range(frame, 1ULL << order, false);
+                    }
+
+                    frame = next;
                 }
             }
+        }
+    }
+
+    g_frame_policies[get_cpu_index()].node = get_cpu_numa_node();
+}
+
+void set_frame_policy(uint8_t mode, uint8_t node) {
+    KERNEL_ASSERT(node < g_node_count, "Not a NUMA node")
+
+    FramePolicy* policy = &g_frame_policies[get_cpu_index()];
+    policy->mode = mode;
+    policy->node = node;
+}
+
+void get_frame_allocator_stats(FrameAllocatorStats* out_stats) {
+    out_stats->timestamp = read_timestamp_counter();
+
+    out_stats->free_pages = 0;
+    for (uint8_t order = 0; order < FRAME_ORDERS; ++order) {
+        out_stats->free_blocks[order] = g_free_lists[order].count;
+        out_stats->free_pages += g_free_lists[order].count << order;
+    }
+
+    out_stats->cached_pages = 0;
+    for (uint64_t i = 0; i < MAX_LAPIC_COUNT; ++i) {
+        for (uint8_t migrate_type = 0; migrate_type < MIGRATE_TYPES; ++migrate_type) {
+            out_stats->cached_pages += g_frame_caches[i][migrate_type].count;
+        }
+    }
+
+    out_stats->zeroed_pages = 0;
+    for (uint8_t i = 0; i < MIGRATE_TYPES; ++i) out_stats->zeroed_pages += g_zeroed_frames[i].count;
+    out_stats->deferred_pages = g_deferred_pageblocks.count << PAGEBLOCK_ORDER;
+
+    out_stats->dma_region_free_pages = 0;
+    for (uint64_t i = 0; i < g_dma_region.count; ++i) {
+        if (!get_dma_region_bit(i)) ++out_stats->dma_region_free_pages;
+    }
+
+    out_stats->allocations = g_frame_stats.allocations;
+    out_stats->frees = g_frame_stats.frees;
+    out_stats->splits = g_frame_stats.splits;
+    out_stats->merges = g_frame_stats.merges;
+}
+
+int32_t get_fragmentation_index(uint8_t order) {
+    KERNEL_ASSERT(order < FRAME_ORDERS, "Not an order")
+
+    uint64_t free_pages = 0;
+    uint64_t free_blocks = 0;
+    for (uint8_t i = 0; i < FRAME_ORDERS; ++i) {
+        // An allocation of order would succeed
+        if (i >= order && g_free_lists[i].count != 0) return -1000;
+
+        free_pages += g_free_lists[i].count << i;
+        free_blocks += g_free_lists[i].count;
+    }
+
+    if (free_blocks == 0) return 0;
+
+    // Same index as Linux. Every free block is smaller than the requested block,
+    // which keeps the quotient below 2000.
+    return 1000 - (int32_t)((1000 + (free_pages * 1000) / (1ULL << order)) / free_blocks);
+}
+
+void add_frame_owner(PhysicalAddress addr) {
+    const uint64_t frame = addr / PAGE_SIZE;
+    KERNEL_ASSERT(frame < g_frame_count, "Frame isn't managed by the frame allocator")
+
+    FrameDescriptor* desc = &g_frame_descriptors[frame];
+    if ((desc->flags & FRAME_SHARED) == 0) {
+        desc->flags |= FRAME_SHARED;
+        desc->owners = 2;
+    }
+    else {
+        ++desc->owners;
+    }
+}
+
+uint32_t remove_frame_owner(PhysicalAddress addr) {
+    FrameDescriptor* desc = &g_frame_descriptors[addr / PAGE_SIZE];
+    KERNEL_ASSERT((desc->flags & FRAME_SHARED) != 0, "Frame isn't shared")
+
+    if (--desc->owners == 1) desc->flags &= ~FRAME_SHARED;
+    return (desc->flags & FRAME_SHARED) != 0 ? desc->owners : 1;
+}
+
+uint32_t get_frame_owners(PhysicalAddress addr) {
+    const FrameDescriptor* desc = &g_frame_descriptors[addr / PAGE_SIZE];
+    return (desc->flags & FRAME_SHARED) != 0 ? desc->owners : 1;
+}
+
+void set_frame_table_entries(PhysicalAddress addr, uint32_t count) {
+    const uint64_t frame = addr / PAGE_SIZE;
+    KERNEL_ASSERT(frame < g_frame_count, "Frame isn't managed by the frame allocator")
+
+    g_frame_descriptors[frame].table_entries = count;
+}
+
+uint32_t add_frame_table_entries(PhysicalAddress addr, int32_t count) {
+    FrameDescriptor* desc = &g_frame_descriptors[addr / PAGE_SIZE];
+    KERNEL_ASSERT(count >= 0 || desc->table_entries >= (uint32_t)-count, "Table entries underflow")
+
+    desc->table_entries += count;
+    return desc->table_entries;
+}
+
+void mark_compaction_frame(PhysicalAddress addr) {
+    const uint64_t frame = addr / PAGE_SIZE;
+
+    // Frames in movable pageblocks are always memory the allocator manages
+    if (frame >= g_frame_count || get_pageblock_type(frame) != MIGRATE_MOVABLE) return;
+
+    // Moving a shared frame would need every address space mapping it to be updated
+    if ((g_frame_descriptors[frame].flags & FRAME_SHARED) != 0) return;
+
+    g_frame_descriptors[frame].flags |= FRAME_COMPACT;
+}
+
+void unmark_compaction_frame(PhysicalAddress addr) {
+    const uint64_t frame = addr / PAGE_SIZE;
+    if (frame >= g_frame_count) return;
+
+    g_frame_descriptors[frame].flags &= ~FRAME_COMPACT;
+}
+
+// Counts the marked frames in a block
+// Returns false if the block has frames which are neither free nor marked
+bool count_compaction_frames(uint64_t frame, uint64_t count, uint64_t* out_marked) {
+    *out_marked = 0;
+
+    const uint64_t end = frame + count;
+    while (frame < end) {
+        if (get_pageblock_type(frame) == PAGEBLOCK_DEFERRED) return false;
+
+        const FrameDescriptor* desc = &g_frame_descriptors[frame];
+        if ((desc->flags & FRAME_FREE) != 0) {
+            frame += 1ULL << desc->order;
+        }
+        else if ((desc->flags & FRAME_COMPACT) != 0) {
+            ++*out_marked;
+            ++frame;
+        }
+        else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool isolate_compaction_block(uint8_t order, PhysicalAddress* out_addr, uint64_t* out_marked) {
+    KERNEL_ASSERT(order < FRAME_ORDERS, "Not an order")
+
+    const uint64_t block_frames = 1ULL << order;
+
+    // Pick the block which needs the fewest frames moved
+    uint64_t best_frame = 0;
+    uint64_t best_marked = UINT64_MAX;
+    for (uint64_t frame = 0; frame + block_frames <= g_frame_count; frame += block_frames) {
+        uint64_t marked;
+        if (!count_compaction_frames(frame, block_frames, &marked)) continue;
+
+        // There already is a free block of order
+        if (marked == 0) return false;
+
+        if (marked < best_marked && !range_crosses_nodes(frame, block_frames)) {
+            best_frame = frame;
+            best_marked = marked;
+        }
+    }
+
+    if (best_marked == UINT64_MAX) return false;
+
+    // Take the free blocks out of the free lists so they aren't handed out while pages are moved
+    for (uint64_t frame = best_frame; frame < best_frame + block_frames;) {
+        const FrameDescriptor* desc = &g_frame_descriptors[frame];
+        if ((desc->flags & FRAME_FREE) == 0) {
+            ++frame;
+            continue;
+        }
+
+        const uint8_t block_order = desc->order;
+        take_free_block(frame, block_order, block_order);
+        frame += 1ULL << block_order;
+    }
+
+    *out_addr = best_frame * PAGE_SIZE;
+    *out_marked = best_marked;
+    return true;
+}
+
+void release_compaction_block(PhysicalAddress addr, uint8_t order, bool migrated) {
+    const uint64_t start = addr / PAGE_SIZE;
+    const uint64_t end = start + (1ULL << order);
+
+    if (migrated) {
+        for (uint64_t frame = start; frame < end; ++frame) {
+            g_frame_descriptors[frame].flags &= ~FRAME_COMPACT;
+        }
+
+        // Every frame in the block is allocated, so it goes back as one block
+        free_block(start, order);
+        return;
+    }
 
-            last = desc;
+    // The marked frames are still mapped, only the frames which were free are given back
+    uint64_t run_start = start;
+    for (uint64_t frame = start; frame <= end; ++frame) {
+        if (frame == end || (g_frame_descriptors[frame].flags & FRAME_COMPACT) != 0) {
+            free_blocks_in_range(run_start, frame - run_start, false);
+            run_start = frame + 1;
         }
     }
 }
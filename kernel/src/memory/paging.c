@@ -10,8 +10,6 @@
 #include <stdbool.h>
 #include <string.h>
 
-#define PAGE_POOL_THRESHOLD 10
-
 #define PAGE_ENTRY_COUNT 512
 #define PT_MEM_RANGE (PAGE_SIZE * PAGE_ENTRY_COUNT)
 #define PD_MEM_RANGE (PT_MEM_RANGE * PAGE_ENTRY_COUNT)
@@ -20,6 +18,13 @@
 #define KERNEL_PML4_OFFSET 480ULL
 #define KERNEL_OFFSET (KERNEL_PML4_OFFSET * PDP_MEM_RANGE)
 
+// The direct map takes up the PML4 entries right before the kernel address space
+#define DIRECT_MAP_PML4_OFFSET ((DIRECT_MAP_OFFSET & NON_EXT_ADDR_MASK) / PDP_MEM_RANGE)
+#define DIRECT_MAP_PML4_COUNT (KERNEL_PML4_OFFSET - DIRECT_MAP_PML4_OFFSET)
+
+// User address spaces get the lower half of the PML4, the upper half is shared with the kernel
+#define USER_PML4_COUNT (PAGE_ENTRY_COUNT / 2)
+
 #define OFFSET_INDEX_MASK 0x1ffULL
 
 #define NON_EXT_ADDR_MASK 0xffffffffffffULL
@@ -29,10 +34,47 @@
 #define PDP 2
 #define PML4 3
 
+// PCID 0 is used by the kernel before any address space is mapped
+#define PCID_COUNT 4096
+
+// Keeps the TLB entries tagged with the new PCID when written to CR3
+#define CR3_NO_FLUSH (1ULL << 63)
+
+// Pages mapped with a faulting page of an area, the window is aligned to its size
+#define FAULT_AROUND_PAGES 8
+
+// Above this many invlpg instructions a TLB gather flushes the whole TLB instead.
+// Not measured on this kernel, the default is the single page flush ceiling of Linux
+// (Documentation/x86/tlb.rst) where invalidating pages one by one stops being cheaper than
+// a full flush and the refills after it. Configured through CMake
+#ifndef TLB_FLUSH_THRESHOLD
+#    define TLB_FLUSH_THRESHOLD 33
+#endif
+
+_Static_assert(TLB_FLUSH_THRESHOLD >= 1, "TLB_FLUSH_THRESHOLD has to be at least one page");
+
+// Internal flag for mappings of frames the address space owns, as opposed to memory it only maps
+#define PAGING_OWNED (1U << 31)
+
+// Makes writes from the kernel fault on read only pages, needed for copy on write
+#define CR0_WP (1ULL << 16)
+
+#define CR4_PGE (1ULL << 7)
+#define CR4_PCIDE (1ULL << 17)
+
 #define GET_LEVEL_INDEX(addr, level) \
     (((addr) & (OFFSET_INDEX_MASK << (12 + 9 * (level)))) >> (12 + 9 * (level)))
 
+// Size of the memory mapped by one entry in a table of level,
+// entries in a PD map 2MiB large pages and entries in a PDP map 1GiB large pages
+#define LEVEL_ENTRY_SIZE(level) (PAGE_SIZE << (9 * (level)))
+
+// Tables last used by a walk over a virtual address range,
+// an index of PAGE_ENTRY_COUNT means no table is cached
 typedef struct {
+    uint16_t pdp_index;
+    PageEntry* pdp;
+
     uint16_t pd_index;
     PageEntry* pd;
 
@@ -40,232 +82,701 @@ typedef struct {
     PageEntry* pt;
 } PageTableLocation;
 
-typedef MappingEntry PagePoolEntry;
+// Range of entries changed or removed by a mapping operation, flushed from the TLB once at the end
+// The range is also what would be sent to the other processors for a shootdown
+typedef struct {
+    AddressSpace* space;
+    VirtualAddress start;
+    VirtualAddress end;
+
+    // Size of the smallest entry gathered, one invlpg per stride covers the range.
+    // Zero when nothing has been gathered
+    uint64_t stride;
+
+    // Page tables emptied by the operation, freed once the flush makes sure nothing walks them.
+    // Linked through the physical address in their first entry, which doesn't look present
+    PhysicalAddress freed_tables;
+    uint64_t freed_table_count;
+} TLBGather;
 
 PageEntry __attribute__((aligned(0x1000))) g_pml4[512] = {0};
 
 bool g_paging_execute_disable = false;
 
+bool g_paging_1gb_pages = false;
+
+bool g_paging_pcid = false;
+
+// Kernel mappings are global, so they stay in the TLB across CR3 loads and are shared by every PCID
+bool g_paging_global = false;
+
+struct {
+    // Address space currently mapped
+    AddressSpace* active;
+
+    // Bumped when kernel mappings are changed or removed, they can be cached under every PCID
+    uint64_t kernel_generation;
+
+    uint16_t next_pcid;
+
+    // Address space which last ran with each PCID, PCIDs are shared once all have been handed out
+    AddressSpace* pcid_spaces[PCID_COUNT];
+} g_tlb = {.next_pcid = 1};
+
+// Kernel mappings are made through the PML4 used at boot,
+// its upper half entries never change after initialization so every PML4 can share them
 AddressSpace g_kernel_space = {
     .current_address = KERNEL_OFFSET,
-    .pdp_index = KERNEL_PML4_OFFSET,
-    .pdp = 0,
+    .end_address = KERNEL_OFFSET + PDP_MEM_RANGE,
+    .pml4 = g_pml4,
     .prot = 0,
-    .free_list = 0,
-    .entry_maps = {0},
+    .free_ranges = 0,
 };
 
-struct {
-    uint64_t count;
-    PagePoolEntry* head;
-} g_page_pool = {0};
-
 // See linker.ld
 extern char s_kernel_rodata_start;
 extern char s_kernel_rodata_end;
 extern char s_kernel_data_start;
 extern char s_kernel_data_end;
 
-void new_address_space(AddressSpace* space, uint16_t pdp_index, uint8_t prot) {
-    KERNEL_ASSERT(pdp_index < KERNEL_PML4_OFFSET,
-                  "AddressSpace can't overlap with kernel address space")
+uint64_t get_free_range_max_pages(const FreeRange* range) {
+    return range == 0 ? 0 : range->max_pages;
+}
+
+// Recalculates the biggest range of a node from its children
+void update_free_range(AddressNode* node) {
+    FreeRange* range = (FreeRange*)node;
+    range->max_pages = MAX((uint64_t)node->pages,
+                           MAX(get_free_range_max_pages(node->left),
+                               get_free_range_max_pages(node->right)));
+}
+
+FreeRange* insert_free_range(FreeRange* root, FreeRange* range) {
+    return (FreeRange*)insert_address_node((AddressNode*)root, &range->node, update_free_range);
+}
+
+FreeRange* remove_free_range(FreeRange* root, uint64_t addr) {
+    return (FreeRange*)remove_address_node((AddressNode*)root, addr, update_free_range);
+}
+
+void update_free_range_path(FreeRange* root, uint64_t addr) {
+    update_address_node_path((AddressNode*)root, addr, update_free_range);
+}
+
+// Finds the range with the lowest address which has at least pages pages
+FreeRange* find_free_range(FreeRange* root, uint64_t pages) {
+    while (root != 0 && root->max_pages >= pages) {
+        if (get_free_range_max_pages(root->node.left) >= pages) {
+            root = root->node.left;
+        }
+        else if (root->node.pages >= pages) {
+            return root;
+        }
+        else {
+            root = root->node.right;
+        }
+    }
+
+    return 0;
+}
+
+FreeRange* find_containing_free_range(FreeRange* root, uint64_t addr) {
+    return (FreeRange*)find_containing_address_node((AddressNode*)root, addr);
+}
+
+FreeRange* find_free_range_below(FreeRange* root, uint64_t addr) {
+    return (FreeRange*)find_address_node_below((AddressNode*)root, addr);
+}
+
+FreeRange* find_free_range_above(FreeRange* root, uint64_t addr) {
+    return (FreeRange*)find_address_node_above((AddressNode*)root, addr);
+}
+
+// Takes pages pages starting at page addr out of the range containing them.
+// The spare node is used when the range is split in two, unused nodes go back to the pool
+// once the tree is consistent again
+void take_from_free_range(AddressSpace* space, FreeRange* range, uint64_t addr, uint64_t pages,
+                          FreeRange* spare) {
+    const uint64_t range_end = range->node.addr + range->node.pages;
+    const uint64_t end = addr + pages;
+    KERNEL_ASSERT(range->node.addr <= addr && end <= range_end, "Pages not in free range")
+
+    if (addr == range->node.addr && end == range_end) {
+        space->free_ranges = remove_free_range(space->free_ranges, range->node.addr);
+        free_pool_entry(ENTRY_POOL_FREE_RANGES, range);
+    }
+    else if (addr == range->node.addr) {
+        // Moving the start keeps the order of the tree
+        range->node.addr = end;
+        range->node.pages = range_end - end;
+        update_free_range_path(space->free_ranges, end);
+    }
+    else {
+        range->node.pages = addr - range->node.addr;
+        update_free_range_path(space->free_ranges, range->node.addr);
+
+        if (end != range_end) {
+            spare->node.addr = end;
+            spare->node.pages = range_end - end;
+            space->free_ranges = insert_free_range(space->free_ranges, spare);
+            return;
+        }
+    }
+
+    free_pool_entry(ENTRY_POOL_FREE_RANGES, spare);
+}
+
+// Gives a range of address space back, merging it with the free ranges next to it.
+// Ranges ending at current_address are given back to never used address space
+void free_addr_space(AddressSpace* space, VirtualAddress virt_addr, uint64_t pages) {
+    // Taken before the tree is used, taking an entry can allocate kernel address space itself
+    FreeRange* spare = alloc_pool_entry(ENTRY_POOL_FREE_RANGES);
+    FreeRange* unused = spare;
+
+    const uint64_t addr = (virt_addr & NON_EXT_ADDR_MASK) >> 12;
+    const uint64_t end = addr + pages;
+
+    FreeRange* below = find_free_range_below(space->free_ranges, addr);
+    if (below != 0 && below->node.addr + below->node.pages != addr) below = 0;
 
+    FreeRange* above = find_free_range_above(space->free_ranges, addr);
+    if (above != 0 && above->node.addr != end) above = 0;
+
+    FreeRange* range;
+    if (below != 0 && above != 0) {
+        below->node.pages += pages + above->node.pages;
+        space->free_ranges = remove_free_range(space->free_ranges, above->node.addr);
+        update_free_range_path(space->free_ranges, below->node.addr);
+
+        free_pool_entry(ENTRY_POOL_FREE_RANGES, spare);
+        unused = above;
+        range = below;
+    }
+    else if (below != 0) {
+        below->node.pages += pages;
+        update_free_range_path(space->free_ranges, below->node.addr);
+        range = below;
+    }
+    else if (above != 0) {
+        // Moving the start keeps the order of the tree
+        above->node.addr = addr;
+        above->node.pages += pages;
+        update_free_range_path(space->free_ranges, addr);
+        range = above;
+    }
+    else {
+        spare->node.addr = addr;
+        spare->node.pages = pages;
+        space->free_ranges = insert_free_range(space->free_ranges, spare);
+        unused = 0;
+        range = spare;
+    }
+
+    if (((range->node.addr + range->node.pages) << 12) == space->current_address) {
+        space->current_address = range->node.addr << 12;
+        space->free_ranges = remove_free_range(space->free_ranges, range->node.addr);
+
+        if (unused != 0) free_pool_entry(ENTRY_POOL_FREE_RANGES, unused);
+        unused = range;
+    }
+
+    if (unused != 0) free_pool_entry(ENTRY_POOL_FREE_RANGES, unused);
+}
+
+// Areas keep nothing about their subtree besides the height
+MemoryArea* insert_area(MemoryArea* root, MemoryArea* area) {
+    return (MemoryArea*)insert_address_node((AddressNode*)root, &area->node, 0);
+}
+
+MemoryArea* remove_area(MemoryArea* root, uint64_t addr) {
+    return (MemoryArea*)remove_address_node((AddressNode*)root, addr, 0);
+}
+
+MemoryArea* find_containing_area(MemoryArea* root, uint64_t addr) {
+    return (MemoryArea*)find_containing_address_node((AddressNode*)root, addr);
+}
+
+MemoryArea* find_area_above(MemoryArea* root, uint64_t addr) {
+    return (MemoryArea*)find_address_node_above((AddressNode*)root, addr);
+}
+
+MemoryArea* find_area(const AddressSpace* space, VirtualAddress virt_addr) {
+    return find_containing_area(space->areas, (virt_addr & NON_EXT_ADDR_MASK) >> 12);
+}
+
+// Records a mapping or reservation of a user address space
+void add_area(AddressSpace* space, VirtualAddress virt_addr, uint64_t pages, PagingFlags flags,
+              uint8_t backing) {
+    if (space == &g_kernel_space) return;
+
+    MemoryArea* area = alloc_pool_entry(ENTRY_POOL_MEMORY_AREAS);
+    area->node.addr = (virt_addr & NON_EXT_ADDR_MASK) >> 12;
+    area->node.pages = pages;
+    area->flags = flags & ~PAGING_OWNED;
+    area->backing = backing;
+    space->areas = insert_area(space->areas, area);
+}
+
+// Splits the area containing page addr so that an area starts at addr
+void split_area(AddressSpace* space, uint64_t addr) {
+    // Taken before the tree is used like for the free ranges
+    MemoryArea* spare = alloc_pool_entry(ENTRY_POOL_MEMORY_AREAS);
+
+    MemoryArea* area = find_containing_area(space->areas, addr);
+    if (area == 0 || area->node.addr == addr) {
+        free_pool_entry(ENTRY_POOL_MEMORY_AREAS, spare);
+        return;
+    }
+
+    *spare = *area;
+    spare->node.addr = addr;
+    spare->node.pages = area->node.addr + area->node.pages - addr;
+    area->node.pages = addr - area->node.addr;
+    space->areas = insert_area(space->areas, spare);
+}
+
+// Checks if every page of the range belongs to an area
+bool range_in_areas(const AddressSpace* space, uint64_t addr, uint64_t end) {
+    const MemoryArea* area = find_containing_area(space->areas, addr);
+    while (area != 0 && area->node.addr + area->node.pages < end) {
+        const uint64_t area_end = area->node.addr + area->node.pages;
+        area = find_area_above(space->areas, area_end);
+        if (area != 0 && area->node.addr != area_end) return false;
+    }
+
+    return area != 0;
+}
+
+// Takes the pages of the range out of the areas, areas partly inside the range are split
+void remove_areas(AddressSpace* space, VirtualAddress virt_addr, uint64_t pages) {
+    if (space == &g_kernel_space) return;
+
+    const uint64_t addr = (virt_addr & NON_EXT_ADDR_MASK) >> 12;
+    const uint64_t end = addr + pages;
+    split_area(space, addr);
+    split_area(space, end);
+
+    MemoryArea* area = find_area_above(space->areas, addr);
+    while (area != 0 && area->node.addr < end) {
+        space->areas = remove_area(space->areas, area->node.addr);
+        free_pool_entry(ENTRY_POOL_MEMORY_AREAS, area);
+        area = find_area_above(space->areas, addr);
+    }
+}
+
+// Sets the flags of the areas of the range, areas partly inside the range are split
+// Returns false without changing anything if part of the range isn't in an area
+bool set_area_flags(AddressSpace* space, VirtualAddress virt_addr, uint64_t pages,
+                    PagingFlags flags) {
+    const uint64_t addr = (virt_addr & NON_EXT_ADDR_MASK) >> 12;
+    const uint64_t end = addr + pages;
+    if (!range_in_areas(space, addr, end)) return false;
+
+    split_area(space, addr);
+    split_area(space, end);
+
+    MemoryArea* area = find_containing_area(space->areas, addr);
+    while (area != 0 && area->node.addr < end) {
+        area->flags = flags;
+        area = find_area_above(space->areas, area->node.addr + area->node.pages);
+    }
+
+    return true;
+}
+
+PageEntry* get_page_entries(const PageEntry* entry) {
+    return (PageEntry*)PHYS_TO_DIRECT_MAP(entry->phys_addr << 12);
+}
+
+void new_address_space(AddressSpace* space, uint8_t prot) {
     memset(space, 0, sizeof(AddressSpace));
 
     KERNEL_ASSERT(prot <= 0b1111, "Prot is only 4 bits page entries")
     space->prot = prot;
 
-    space->pdp_index = pdp_index;
-    space->current_address = pdp_index * PDP_MEM_RANGE;
-
     // Make sure virtual address zero is never used
-    if (space->current_address == 0) space->current_address += PAGE_SIZE;
-
-    // Allocate PDP
-    space->pdp = (PageEntry*)alloc_pages_contiguous(1, PAGING_WRITABLE);
-    KERNEL_ASSERT(space->pdp != 0, "Out of memory")
+    space->current_address = PAGE_SIZE;
+    space->end_address = USER_PML4_COUNT * PDP_MEM_RANGE;
 
-    memset((void*)space->pdp, 0, PAGE_SIZE);
-}
+    // Whatever is cached for the PCID belongs to an earlier address space
+    space->pcid = g_tlb.next_pcid;
+    space->tlb_stale = true;
+    g_tlb.next_pcid = g_tlb.next_pcid % (PCID_COUNT - 1) + 1;
 
-void delete_address_space(AddressSpace* space) {
-    // Free free list entries
+    // Allocate PML4 and share the kernel half
     {
-        FreeListEntry* free_entry = space->free_list;
-        while (free_entry != 0) {
-            MemoryEntry* mem_entry = (MemoryEntry*)free_entry;
-            free_entry = (FreeListEntry*)SIGN_EXT_ADDR(free_entry->next);
-            free_memory_entry(mem_entry);
+        PhysicalAddress phys_addr;
+        const bool success = alloc_zeroed_frame(&phys_addr);
+        KERNEL_ASSERT(success, "Out of memory")
+
+        space->pml4 = (PageEntry*)PHYS_TO_DIRECT_MAP(phys_addr);
+        for (uint16_t i = USER_PML4_COUNT; i < PAGE_ENTRY_COUNT; ++i) {
+            space->pml4[i].value = g_pml4[i].value;
         }
     }
+}
 
-    // Free page entries and mapping entries
-    {
-        for (uint8_t i = 0; i < 2; ++i) {
-            MappingEntry* map_entry = space->entry_maps[i];
-            while (map_entry != 0) {
-                // Free page entry memory
-                free_pages_contiguous((void*)SIGN_EXT_ADDR(map_entry->virt_addr << 12), 1);
-
-                // Free memory entry
-                MemoryEntry* mem_entry = (MemoryEntry*)map_entry;
-                map_entry = (MappingEntry*)SIGN_EXT_ADDR(map_entry->next);
-                free_memory_entry(mem_entry);
+void delete_address_space(AddressSpace* space) {
+    KERNEL_ASSERT(g_tlb.active != space, "Can't delete the address space in use")
+    if (g_tlb.pcid_spaces[space->pcid] == space) g_tlb.pcid_spaces[space->pcid] = 0;
+
+    free_address_tree((AddressNode*)space->free_ranges, ENTRY_POOL_FREE_RANGES);
+
+    // Frames of the areas are owned by them like any other mapping
+    free_address_tree((AddressNode*)space->areas, ENTRY_POOL_MEMORY_AREAS);
+
+    // Free page tables of the user half, large pages point to memory owned by the mappings
+    for (uint16_t pdp_index = 0; pdp_index < USER_PML4_COUNT; ++pdp_index) {
+        const PageEntry* pml4_entry = &space->pml4[pdp_index];
+        if (!pml4_entry->present) continue;
+
+        const PageEntry* pdp = get_page_entries(pml4_entry);
+        for (uint16_t pd_index = 0; pd_index < PAGE_ENTRY_COUNT; ++pd_index) {
+            if (!pdp[pd_index].present || pdp[pd_index].large) continue;
+
+            const PageEntry* pd = get_page_entries(&pdp[pd_index]);
+            for (uint16_t pt_index = 0; pt_index < PAGE_ENTRY_COUNT; ++pt_index) {
+                if (!pd[pt_index].present || pd[pt_index].large) continue;
+                free_frame(pd[pt_index].phys_addr << 12, false);
             }
+
+            free_frame(pdp[pd_index].phys_addr << 12, false);
         }
+
+        free_frame(pml4_entry->phys_addr << 12, false);
     }
 
-    // Free PDP
-    free_pages_contiguous(space->pdp, 1);
+    // Free PML4
+    free_frame(DIRECT_MAP_TO_PHYS(space->pml4), false);
 }
 
+// Loads the PML4 of space, the TLB entries cached for its PCID are kept
+// if nothing they map has changed since the address space last ran
 void map_address_space(AddressSpace* space) {
-    {
-        PhysicalAddress pdp_phys_addr;
-        const bool success = kvirt_to_phys_addr((VirtualAddress)space->pdp, &pdp_phys_addr);
-        KERNEL_ASSERT(success, "Could not find physical address")
-        g_pml4[space->pdp_index].phys_addr = pdp_phys_addr >> 12;
+    KERNEL_ASSERT(space != &g_kernel_space, "The kernel is mapped into every address space")
+
+    uint64_t cr3 = DIRECT_MAP_TO_PHYS(space->pml4);
+    if (g_paging_pcid) {
+        const bool flush = space->tlb_stale || g_tlb.pcid_spaces[space->pcid] != space ||
+                           space->kernel_tlb_generation != g_tlb.kernel_generation;
+
+        cr3 |= space->pcid;
+        if (!flush) cr3 |= CR3_NO_FLUSH;
     }
 
-    g_pml4[space->pdp_index].present = true;
-    g_pml4[space->pdp_index].write = true;
-    g_pml4[space->pdp_index].prot = space->prot;
-    g_pml4[space->pdp_index].user = space->prot == 3;
+    asm volatile("mov %[cr3], %%cr3" : : [cr3] "r"(cr3) : "memory");
 
-    // Invalidate TLB entries
-    for (VirtualAddress virt_addr = space->pdp_index * PDP_MEM_RANGE;
-         virt_addr < space->current_address;
-         virt_addr += PAGE_SIZE) {
-        asm volatile("invlpg (%[virt_addr])\n" : : [virt_addr] "r"(virt_addr) : "memory");
+    space->tlb_stale = false;
+    space->kernel_tlb_generation = g_tlb.kernel_generation;
+    g_tlb.pcid_spaces[space->pcid] = space;
+    g_tlb.active = space;
+}
+
+// Flushes the whole TLB, global entries are only dropped when CR4.PGE is toggled
+void flush_tlb_global() {
+    if (g_paging_global) {
+        asm volatile("mov %%cr4, %%rax\n"
+                     "xor %[pge], %%rax\n"
+                     "mov %%rax, %%cr4\n"
+                     "xor %[pge], %%rax\n"
+                     "mov %%rax, %%cr4\n"
+                     :
+                     : [pge] "r"(CR4_PGE)
+                     : "rax", "memory");
+    }
+    else {
+        asm volatile("mov %%cr3, %%rax\n"
+                     "mov %%rax, %%cr3\n"
+                     :
+                     :
+                     : "rax", "memory");
     }
 }
 
-void unmap_address_space(AddressSpace* space) {
-    g_pml4[space->pdp_index].value = 0;
+void init_tlb_gather(TLBGather* gather, AddressSpace* space) {
+    gather->space = space;
+    gather->start = 0;
+    gather->end = 0;
+    gather->stride = 0;
+    gather->freed_tables = 0;
+    gather->freed_table_count = 0;
+}
 
-    // Invalidate TLB entries
-    for (VirtualAddress virt_addr = space->pdp_index * PDP_MEM_RANGE;
-         virt_addr < space->current_address;
-         virt_addr += PAGE_SIZE) {
-        asm volatile("invlpg (%[virt_addr])\n" : : [virt_addr] "r"(virt_addr) : "memory");
+// Adds an entry of size which was changed or removed to the gathered range
+void tlb_gather_add(TLBGather* gather, VirtualAddress virt_addr, uint64_t size) {
+    if (gather->stride == 0) {
+        gather->start = virt_addr;
+        gather->end = virt_addr + size;
+        gather->stride = size;
+        return;
     }
+
+    gather->start = MIN(gather->start, virt_addr);
+    gather->end = MAX(gather->end, virt_addr + size);
+    gather->stride = MIN(gather->stride, size);
 }
 
-PageEntry* get_page_entries(AddressSpace* space, const PageEntry* entry, uint8_t level) {
-    PhysicalAddress phys_addr = entry->phys_addr;
-    MappingEntry* mapping = space->entry_maps[level];
-    while (mapping != 0) {
-        if (mapping->phys_addr == phys_addr) {
-            return (PageEntry*)SIGN_EXT_ADDR(mapping->virt_addr << 12);
-        }
-        mapping = (MappingEntry*)SIGN_EXT_ADDR(mapping->next);
+// Invalidates the gathered range, page by page for small ranges and by flushing the TLB otherwise
+// Address spaces which aren't mapped are flushed the next time they are.
+// invlpg drops global kernel entries for every PCID, without global pages kernel mappings
+// are cached under every PCID so every other address space is flushed
+void flush_tlb_gather(TLBGather* gather) {
+    if (gather->stride == 0 && gather->freed_table_count == 0) return;
+
+    AddressSpace* space = gather->space;
+    if (space == &g_kernel_space && !g_paging_global) {
+        ++g_tlb.kernel_generation;
+
+        // The entries of the active PCID are kept current below
+        if (g_tlb.active != 0) g_tlb.active->kernel_tlb_generation = g_tlb.kernel_generation;
     }
-    return 0;
-}
 
-PageEntry* get_or_alloc_page_entries(AddressSpace* space, PageEntry* entry, uint8_t level) {
-    if (entry->present) {
-        return get_page_entries(space, entry, level);
+    // Freed tables can be held by the paging structure caches, which only a full flush drops.
+    // Toggling CR4.PGE for the kernel drops them for every PCID
+    const bool freed_tables = gather->freed_table_count != 0;
+    if (space != &g_kernel_space && space != g_tlb.active) {
+        space->tlb_stale = true;
+    }
+    else if (!freed_tables &&
+             (gather->end - gather->start) / gather->stride <= TLB_FLUSH_THRESHOLD) {
+        for (VirtualAddress virt_addr = gather->start; virt_addr < gather->end;
+             virt_addr += gather->stride) {
+            asm volatile("invlpg (%[virt_addr])\n" : : [virt_addr] "r"(virt_addr) : "memory");
+        }
+    }
+    else if (space == &g_kernel_space) {
+        flush_tlb_global();
     }
     else {
-        if (space == &g_kernel_space) {
-            if (g_page_pool.count <= PAGE_POOL_THRESHOLD) {
-                // Adjust pool count beforehand to avoid getting stuck in an infinite loop
-                g_page_pool.count += PAGE_POOL_THRESHOLD;
-
-                PageFrameAllocation* allocation = alloc_frames(PAGE_POOL_THRESHOLD);
-                KERNEL_ASSERT(allocation != 0, "Out of memory")
-
-                VirtualAddress virt_addr = kmap_allocation(allocation, PAGING_WRITABLE);
-
-                // Populate pool with allocated pages
-                while (allocation != 0) {
-                    PhysicalAddress phys_addr = allocation->addr;
-                    const uint64_t pages = get_frame_order_size(allocation->order) / PAGE_SIZE;
-                    for (uint64_t i = 0; i < pages; ++i) {
-                        PagePoolEntry* entry = (PagePoolEntry*)get_memory_entry();
-                        entry->next = (VirtualAddress)g_page_pool.head;
-                        entry->virt_addr = virt_addr >> 12;
-
-                        entry->phys_addr = phys_addr >> 12;
-                        g_page_pool.head = entry;
-                        virt_addr += PAGE_SIZE;
-                        phys_addr += PAGE_SIZE;
-                    }
-                    MemoryEntry* memory_entry = (MemoryEntry*)allocation;
-                    allocation = allocation->next;
-                    free_memory_entry(memory_entry);
-                }
-            }
+        // Loading CR3 without the no flush bit drops the entries of the current PCID
+        asm volatile("mov %%cr3, %%rax\n"
+                     "mov %%rax, %%cr3\n"
+                     :
+                     :
+                     : "rax", "memory");
+    }
 
-            PagePoolEntry* pool_entry = g_page_pool.head;
-            g_page_pool.head = (PagePoolEntry*)SIGN_EXT_ADDR(pool_entry->next);
-            --g_page_pool.count;
+    gather->stride = 0;
 
-            pool_entry->next = (VirtualAddress)space->entry_maps[level];
-            space->entry_maps[level] = pool_entry;
+    while (gather->freed_table_count != 0) {
+        const PhysicalAddress phys_addr = gather->freed_tables;
+        gather->freed_tables = ((PageEntry*)PHYS_TO_DIRECT_MAP(phys_addr))->value;
+        --gather->freed_table_count;
 
-            entry->phys_addr = pool_entry->phys_addr;
-            entry->present = true;
-            entry->write = true;
+        free_frame(phys_addr, false);
+    }
+}
 
-            PageEntry* entries = (PageEntry*)SIGN_EXT_ADDR(pool_entry->virt_addr << 12);
+// Allocates a cleared table of page entries, tables are reached through the direct map
+// Tables below the PML4s count their present entries in the descriptor of their frame,
+// so the tables left empty by unmapping are found without scanning them.
+// PML4s are only freed together with their address space and aren't counted
+void count_table_entry(AddressSpace* space, PageEntry* entry, bool present) {
+    const VirtualAddress table_addr = (VirtualAddress)entry & ~(PAGE_SIZE - 1);
+    if (table_addr == (VirtualAddress)space->pml4) return;
 
-            memset((void*)entries, 0, PAGE_SIZE);
+    add_frame_table_entries(DIRECT_MAP_TO_PHYS(table_addr), present ? 1 : -1);
+}
+
+uint32_t get_table_entry_count(const PageEntry* entries) {
+    return add_frame_table_entries(DIRECT_MAP_TO_PHYS(entries), 0);
+}
+
+// Counts the entries of a table of level and the tables below it,
+// for the tables built before the frame allocator was initialized
+void count_boot_table_entries(PageEntry* entries, uint8_t level) {
+    uint32_t count = 0;
+    for (uint16_t i = 0; i < PAGE_ENTRY_COUNT; ++i) {
+        if (!entries[i].present) continue;
 
-            return entries;
+        ++count;
+        if (level != PT && !entries[i].large) {
+            count_boot_table_entries(get_page_entries(&entries[i]), level - 1);
         }
-        else {
-            PhysicalAddress phys_addr;
-            const bool success = alloc_frames_contiguos(1, &phys_addr);
-            KERNEL_ASSERT(success, "Out of memory")
+    }
 
-            entry->phys_addr = phys_addr >> 12;
-            entry->present = true;
-            entry->write = true;
-            entry->prot = space->prot;
-            entry->user = space->prot == 3;
+    set_frame_table_entries(DIRECT_MAP_TO_PHYS(entries), count);
+}
 
-            const VirtualAddress virt_addr = kmap_phys_range(phys_addr, 1, PAGING_WRITABLE);
-            memset((void*)virt_addr, 0, PAGE_SIZE);
+// Allocates an empty table
+PageEntry* alloc_page_entries(PhysicalAddress* out_phys_addr) {
+    const bool success = alloc_zeroed_frame(out_phys_addr);
+    KERNEL_ASSERT(success, "Out of memory")
 
-            MappingEntry* mapping_entry = (MappingEntry*)get_memory_entry();
-            mapping_entry->virt_addr = virt_addr >> 12;
-            mapping_entry->phys_addr = phys_addr >> 12;
-            mapping_entry->next = (VirtualAddress)space->entry_maps[level];
-            space->entry_maps[level] = mapping_entry;
+    set_frame_table_entries(*out_phys_addr, 0);
+    return (PageEntry*)PHYS_TO_DIRECT_MAP(*out_phys_addr);
+}
 
-            return (PageEntry*)virt_addr;
-        }
+// Points entry to a table of page entries
+void set_table_entry(AddressSpace* space, PageEntry* entry, PhysicalAddress phys_addr) {
+    PageEntry table_entry = {.value = 0};
+    table_entry.phys_addr = phys_addr >> 12;
+    table_entry.present = true;
+    table_entry.write = true;
+    table_entry.prot = space->prot;
+    table_entry.user = space->prot == 3;
+
+    // Written in one go so that the entry is never seen half updated
+    entry->value = table_entry.value;
+}
+
+PageEntry* get_or_alloc_page_entries(AddressSpace* space, PageEntry* entry) {
+    if (entry->present) return get_page_entries(entry);
+
+    PhysicalAddress phys_addr;
+    PageEntry* entries = alloc_page_entries(&phys_addr);
+    set_table_entry(space, entry, phys_addr);
+    count_table_entry(space, entry, true);
+    return entries;
+}
+
+// Replaces a large page entry with a table of level mapping the same memory with smaller entries
+PageEntry* split_large_page(AddressSpace* space, PageEntry* entry, uint8_t level,
+                            VirtualAddress virt_addr) {
+    PhysicalAddress phys_addr;
+    PageEntry* entries = alloc_page_entries(&phys_addr);
+
+    // The new entries keep the flags of the large page, in a PT the large bit is used for PAT
+    PageEntry small_entry = *entry;
+    small_entry.large = level != PT;
+    for (uint16_t i = 0; i < PAGE_ENTRY_COUNT; ++i) {
+        entries[i] = small_entry;
+        small_entry.phys_addr += LEVEL_ENTRY_SIZE(level) >> 12;
     }
+
+    set_frame_table_entries(phys_addr, PAGE_ENTRY_COUNT);
+    set_table_entry(space, entry, phys_addr);
+
+    // The large page is dropped from the TLB right away so that both sizes are never cached
+    TLBGather gather;
+    init_tlb_gather(&gather, space);
+    tlb_gather_add(&gather, virt_addr, LEVEL_ENTRY_SIZE(level + 1));
+    flush_tlb_gather(&gather);
+
+    return entries;
 }
 
-__attribute__((always_inline)) void populate_page_table_location(AddressSpace* space,
-                                                                 VirtualAddress virt_addr,
-                                                                 PageTableLocation* location,
-                                                                 bool alloc_entries) {
-    location->pd_index = GET_LEVEL_INDEX(virt_addr, PDP);
-    {
-        PageEntry* entry = &space->pdp[location->pd_index];
-        location->pd = alloc_entries ? get_or_alloc_page_entries(space, entry, PD)
-                                     : get_page_entries(space, entry, PD);
+void reset_page_table_location(PageTableLocation* location) {
+    location->pdp_index = PAGE_ENTRY_COUNT;
+    location->pdp = 0;
+    location->pd_index = PAGE_ENTRY_COUNT;
+    location->pd = 0;
+    location->pt_index = PAGE_ENTRY_COUNT;
+    location->pt = 0;
+}
+
+// Checks if the range starts at and covers a whole entry in a table of level
+bool range_covers_entry(VirtualAddress virt_addr, uint64_t pages, uint8_t level) {
+    const uint64_t size = LEVEL_ENTRY_SIZE(level);
+    return (virt_addr % size) == 0 && pages * PAGE_SIZE >= size;
+}
+
+// Gets the entry to map virt_addr with, tables on the way are allocated when missing
+// Entries in a PD or PDP are used as large pages when both addresses are aligned to them
+PageEntry* get_map_entry(AddressSpace* space, VirtualAddress virt_addr, PhysicalAddress phys_addr,
+                         uint64_t pages, PageTableLocation* location, uint8_t* out_level) {
+    const uint16_t pdp_index = GET_LEVEL_INDEX(virt_addr, PML4);
+    if (pdp_index != location->pdp_index) {
+        location->pdp_index = pdp_index;
+        location->pdp = get_or_alloc_page_entries(space, &space->pml4[pdp_index]);
+        location->pd_index = PAGE_ENTRY_COUNT;
     }
 
-    location->pt_index = GET_LEVEL_INDEX(virt_addr, PD);
-    {
-        PageEntry* entry = &location->pd[location->pt_index];
-        location->pt = alloc_entries ? get_or_alloc_page_entries(space, entry, PT)
-                                     : get_page_entries(space, entry, PT);
+    const uint16_t pd_index = GET_LEVEL_INDEX(virt_addr, PDP);
+    if (pd_index != location->pd_index) {
+        PageEntry* entry = &location->pdp[pd_index];
+        if (!entry->present && g_paging_1gb_pages && range_covers_entry(virt_addr, pages, PDP) &&
+            (phys_addr % LEVEL_ENTRY_SIZE(PDP)) == 0) {
+            *out_level = PDP;
+            return entry;
+        }
+
+        KERNEL_ASSERT(!entry->large, "Virtual address is already mapped")
+
+        location->pd_index = pd_index;
+        location->pd = get_or_alloc_page_entries(space, entry);
+        location->pt_index = PAGE_ENTRY_COUNT;
     }
+
+    const uint16_t pt_index = GET_LEVEL_INDEX(virt_addr, PD);
+    if (pt_index != location->pt_index) {
+        PageEntry* entry = &location->pd[pt_index];
+        if (!entry->present && range_covers_entry(virt_addr, pages, PD) &&
+            (phys_addr % LEVEL_ENTRY_SIZE(PD)) == 0) {
+            *out_level = PD;
+            return entry;
+        }
+
+        KERNEL_ASSERT(!entry->large, "Virtual address is already mapped")
+
+        location->pt_index = pt_index;
+        location->pt = get_or_alloc_page_entries(space, entry);
+    }
+
+    *out_level = PT;
+    return &location->pt[GET_LEVEL_INDEX(virt_addr, PT)];
 }
 
-void add_range_to_free_list(AddressSpace* space, VirtualAddress virt_addr, uint64_t pages) {
-    FreeListEntry* entry = (FreeListEntry*)get_memory_entry();
-    entry->addr = virt_addr >> 12;
-    entry->pages = pages;
+// Gets the entry mapping virt_addr, large pages which the range only covers part of are split
+// Returns 0 if there is no table for the address, out_level is then the level of the entry
+// which isn't present
+PageEntry* get_range_entry(AddressSpace* space, VirtualAddress virt_addr, uint64_t pages,
+                           PageTableLocation* location, uint8_t* out_level) {
+    const uint16_t pdp_index = GET_LEVEL_INDEX(virt_addr, PML4);
+    if (pdp_index != location->pdp_index) {
+        *out_level = PML4;
+        if (!space->pml4[pdp_index].present) return 0;
+
+        location->pdp_index = pdp_index;
+        location->pdp = get_page_entries(&space->pml4[pdp_index]);
+        location->pd_index = PAGE_ENTRY_COUNT;
+    }
+
+    const uint16_t pd_index = GET_LEVEL_INDEX(virt_addr, PDP);
+    if (pd_index != location->pd_index) {
+        PageEntry* entry = &location->pdp[pd_index];
+        *out_level = PDP;
+        if (!entry->present) return 0;
+
+        if (entry->large) {
+            if (range_covers_entry(virt_addr, pages, PDP)) {
+                *out_level = PDP;
+                return entry;
+            }
+
+            location->pd = split_large_page(space, entry, PD, virt_addr);
+        }
+        else {
+            location->pd = get_page_entries(entry);
+        }
 
-    entry->next = (VirtualAddress)space->free_list;
-    space->free_list = entry;
+        location->pd_index = pd_index;
+        location->pt_index = PAGE_ENTRY_COUNT;
+    }
+
+    const uint16_t pt_index = GET_LEVEL_INDEX(virt_addr, PD);
+    if (pt_index != location->pt_index) {
+        PageEntry* entry = &location->pd[pt_index];
+        *out_level = PD;
+        if (!entry->present) return 0;
+
+        if (entry->large) {
+            if (range_covers_entry(virt_addr, pages, PD)) {
+                *out_level = PD;
+                return entry;
+            }
+
+            location->pt = split_large_page(space, entry, PT, virt_addr);
+        }
+        else {
+            location->pt = get_page_entries(entry);
+        }
+
+        location->pt_index = pt_index;
+    }
+
+    *out_level = PT;
+    return &location->pt[GET_LEVEL_INDEX(virt_addr, PT)];
 }
 
 void set_flags(PageEntry* entry, PagingFlags flags) {
@@ -275,92 +786,85 @@ void set_flags(PageEntry* entry, PagingFlags flags) {
     entry->execute_disable = ((flags & PAGING_EXECUTABLE) == 0) && g_paging_execute_disable;
 }
 
-VirtualAddress alloc_addr_space(AddressSpace* space, uint64_t pages) {
-    // Find previously used address space
-    FreeListEntry* entry = space->free_list;
-    {
-        FreeListEntry* last = 0;
-        while (entry != 0) {
-            // TODO(Anton Lilja, 01/05/2021):
-            // We could probably do this a smarter way,
-            // so that we don't fragment address space as much
-            if (pages < entry->pages) {
-                const VirtualAddress addr = entry->addr << 12;
-                entry->addr = (addr + pages * PAGE_SIZE) >> 12;
-                entry->pages += pages;
-                return SIGN_EXT_ADDR(addr);
-            }
-            else if (entry->pages == pages) {
-                if (last == 0) {
-                    space->free_list = (FreeListEntry*)entry->next;
-                }
-                else {
-                    last->next = entry->next;
-                }
+// Gets the size of the biggest large page a range of pages can be mapped with, 0 if none
+uint64_t get_range_large_page_size(uint64_t pages) {
+    if (g_paging_1gb_pages && pages * PAGE_SIZE >= LEVEL_ENTRY_SIZE(PDP)) {
+        return LEVEL_ENTRY_SIZE(PDP);
+    }
 
-                const VirtualAddress addr = entry->addr << 12;
-                free_memory_entry((MemoryEntry*)entry);
-                return SIGN_EXT_ADDR(addr);
-            }
+    if (pages * PAGE_SIZE >= LEVEL_ENTRY_SIZE(PD)) return LEVEL_ENTRY_SIZE(PD);
+    return 0;
+}
 
-            last = entry;
-            entry = (FreeListEntry*)SIGN_EXT_ADDR(entry->next);
-        }
-    }
+// Ranges big enough for large pages get an address with the same large page offset as phys_addr
+VirtualAddress alloc_addr_space(AddressSpace* space, uint64_t pages, PhysicalAddress phys_addr) {
+    const uint64_t large_page_size = get_range_large_page_size(pages);
 
-    VirtualAddress addr = space->current_address;
-    space->current_address += pages * PAGE_SIZE;
+    // Taken before the tree is used, taking an entry can allocate kernel address space itself
+    FreeRange* spare = alloc_pool_entry(ENTRY_POOL_FREE_RANGES);
 
-    KERNEL_ASSERT(space->current_address < ((space->pdp_index + 1) * PDP_MEM_RANGE),
-                  "Out of address space")
-    return SIGN_EXT_ADDR(addr);
-}
+    // Ranges for large pages need room to be aligned in, otherwise unused space is preferred
+    const uint64_t align_pages = large_page_size == 0 ? 0 : large_page_size / PAGE_SIZE - 1;
+    FreeRange* range = find_free_range(space->free_ranges, pages + align_pages);
+    if (range != 0) {
+        VirtualAddress addr = range->node.addr << 12;
+        if (large_page_size != 0) addr += (phys_addr - addr) & (large_page_size - 1);
 
-void page_table_traversal_helper(AddressSpace* space, VirtualAddress virt_addr,
-                                 PageTableLocation* location, bool alloc_entries) {
-    const uint16_t new_pd_index = GET_LEVEL_INDEX(virt_addr, PDP);
-    const uint16_t new_pt_index = GET_LEVEL_INDEX(virt_addr, PD);
-    if (new_pd_index != location->pd_index) {
-        location->pd_index = new_pd_index;
-        location->pt_index = 0;
+        take_from_free_range(space, range, addr >> 12, pages, spare);
+        return SIGN_EXT_ADDR(addr);
+    }
+
+    const VirtualAddress skipped_addr = space->current_address;
+
+    VirtualAddress addr = space->current_address;
+    if (large_page_size != 0) addr += (phys_addr - addr) & (large_page_size - 1);
+    space->current_address = addr + pages * PAGE_SIZE;
 
-        location->pd = alloc_entries
-                           ? get_or_alloc_page_entries(space, &space->pdp[location->pd_index], PD)
-                           : get_page_entries(space, &space->pdp[location->pd_index], PD);
-        KERNEL_ASSERT(location->pd, "PD not present")
+    KERNEL_ASSERT(space->current_address <= space->end_address, "Out of address space")
 
-        location->pt = alloc_entries
-                           ? get_or_alloc_page_entries(space, &location->pd[location->pt_index], PT)
-                           : get_page_entries(space, &location->pd[location->pt_index], PT);
-        KERNEL_ASSERT(location->pt, "PT not present")
+    // Address space skipped for alignment is left to smaller ranges
+    if (addr != skipped_addr) {
+        spare->node.addr = skipped_addr >> 12;
+        spare->node.pages = (addr - skipped_addr) / PAGE_SIZE;
+        space->free_ranges = insert_free_range(space->free_ranges, spare);
     }
-    else if (new_pt_index != location->pt_index) {
-        location->pt_index = new_pt_index;
-        location->pt = alloc_entries
-                           ? get_or_alloc_page_entries(space, &location->pd[location->pt_index], PT)
-                           : get_page_entries(space, &location->pd[location->pt_index], PT);
-        KERNEL_ASSERT(location->pt, "PT not present")
+    else {
+        free_pool_entry(ENTRY_POOL_FREE_RANGES, spare);
     }
+
+    return SIGN_EXT_ADDR(addr);
 }
 
 void map_range_helper(AddressSpace* space, VirtualAddress virt_addr, PhysicalAddress phys_addr,
-                      uint64_t pages, PagingFlags flags, PageTableLocation* location) {
-    for (uint64_t i = 0; i < pages; ++i) {
-        page_table_traversal_helper(space, virt_addr, location, true);
-
-        const uint16_t index = GET_LEVEL_INDEX(virt_addr, PT);
-        location->pt[index].phys_addr = phys_addr >> 12;
-        location->pt[index].present = true;
-        set_flags(&location->pt[index], flags);
+                      uint64_t pages, PagingFlags flags, PageTableLocation* location,
+                      TLBGather* gather) {
+    while (pages != 0) {
+        uint8_t level;
+        PageEntry* entry = get_map_entry(space, virt_addr, phys_addr, pages, location, &level);
+        const uint64_t size = LEVEL_ENTRY_SIZE(level);
+
+        // Entries which weren't present are never cached, only replaced ones are invalidated
+        if (entry->present) {
+            tlb_gather_add(gather, virt_addr, size);
+        }
+        else {
+            count_table_entry(space, entry, true);
+        }
 
-        location->pt[index].prot = space->prot;
-        location->pt[index].user = space->prot == 3;
+        entry->phys_addr = phys_addr >> 12;
+        entry->present = true;
+        entry->large = level != PT;
+        entry->global = space == &g_kernel_space;
+        entry->owned = (flags & PAGING_OWNED) != 0;
+        entry->copy_on_write = false;
+        set_flags(entry, flags);
 
-        // Invalidate TLB entry for page belonging to virtual address
-        asm volatile("invlpg (%[virt_addr])\n" : : [virt_addr] "r"(virt_addr) : "memory");
+        entry->prot = space->prot;
+        entry->user = space->prot == 3;
 
-        phys_addr += PAGE_SIZE;
-        virt_addr += PAGE_SIZE;
+        phys_addr += size;
+        virt_addr += size;
+        pages -= size / PAGE_SIZE;
     }
 }
 
@@ -368,53 +872,82 @@ VirtualAddress map_allocation(AddressSpace* space, PageFrameAllocation* allocati
                               PagingFlags flags) {
     const uint64_t total_pages = calculate_allocation_pages(allocation);
 
-    const VirtualAddress virt_addr = alloc_addr_space(space, total_pages);
+    const VirtualAddress virt_addr = alloc_addr_space(space, total_pages, allocation->addr);
     VirtualAddress curr_virt_addr = virt_addr;
 
     PageTableLocation location;
-    populate_page_table_location(space, virt_addr, &location, true);
+    reset_page_table_location(&location);
 
+    TLBGather gather;
+    init_tlb_gather(&gather, space);
+
+    // Physically contiguos runs of blocks are mapped in one go
     while (allocation != 0) {
-        uint64_t allocation_size = get_frame_order_size(allocation->order);
-        uint64_t pages = allocation_size / PAGE_SIZE;
-        map_range_helper(space, curr_virt_addr, allocation->addr, pages, flags, &location);
-        allocation = allocation->next;
-        curr_virt_addr += allocation_size;
+        const PhysicalAddress phys_addr = allocation->addr;
+        uint64_t pages;
+        allocation = get_allocation_run(allocation, &pages);
+        map_range_helper(
+            space, curr_virt_addr, phys_addr, pages, flags | PAGING_OWNED, &location, &gather);
+        curr_virt_addr += pages * PAGE_SIZE;
     }
 
+    flush_tlb_gather(&gather);
+
+    add_area(space, virt_addr, total_pages, flags, AREA_FRAMES);
     return virt_addr;
 }
 
 VirtualAddress map_phys_range(AddressSpace* space, PhysicalAddress phys_addr, uint64_t pages,
                               PagingFlags flags) {
-    const VirtualAddress virt_addr = alloc_addr_space(space, pages);
+    const VirtualAddress virt_addr = alloc_addr_space(space, pages, phys_addr);
 
     PageTableLocation location;
-    populate_page_table_location(space, virt_addr, &location, true);
+    reset_page_table_location(&location);
+
+    TLBGather gather;
+    init_tlb_gather(&gather, space);
+
+    map_range_helper(space, virt_addr, phys_addr, pages, flags, &location, &gather);
 
-    map_range_helper(space, virt_addr, phys_addr, pages, flags, &location);
+    flush_tlb_gather(&gather);
+
+    add_area(space, virt_addr, pages, flags, AREA_PHYS);
     return virt_addr;
 }
 
 bool claim_virt_range(AddressSpace* space, VirtualAddress virt_addr, uint64_t pages) {
-    if (space->current_address <= (virt_addr & NON_EXT_ADDR_MASK)) {
-        // Check if virtual address range would be outside of the PDP range
-        if (virt_addr + (pages * PAGE_SIZE) > (space->pdp_index + 1) * PDP_MEM_RANGE) return false;
+    const VirtualAddress addr = virt_addr & NON_EXT_ADDR_MASK;
+    const VirtualAddress end_addr = addr + pages * PAGE_SIZE;
+
+    // Check if virtual address range would be outside of the address space
+    if (end_addr > space->end_address) return false;
 
-        FreeListEntry* free_entry = (FreeListEntry*)get_memory_entry();
-        free_entry->addr = space->current_address >> 12;
-        free_entry->pages = (virt_addr - space->current_address) / PAGE_SIZE;
-        free_entry->next = (VirtualAddress)space->free_list;
-        space->free_list = free_entry;
+    // Taken before the tree is used, taking an entry can allocate kernel address space itself
+    FreeRange* spare = alloc_pool_entry(ENTRY_POOL_FREE_RANGES);
 
-        space->current_address = (virt_addr + pages * PAGE_SIZE) & NON_EXT_ADDR_MASK;
+    if (space->current_address <= addr) {
+        // No free range ends at current_address, so the skipped space is never merged
+        if (space->current_address != addr) {
+            spare->node.addr = space->current_address >> 12;
+            spare->node.pages = (addr - space->current_address) / PAGE_SIZE;
+            space->free_ranges = insert_free_range(space->free_ranges, spare);
+        }
+        else {
+            free_pool_entry(ENTRY_POOL_FREE_RANGES, spare);
+        }
+
+        space->current_address = end_addr;
+        return true;
     }
-    else {
-        // TODO(Anton Lilja, 11/05/2021):
-        // Look through free lists to see if address range is available
+
+    // Below current_address the whole range has to be inside one free range
+    FreeRange* range = find_containing_free_range(space->free_ranges, addr >> 12);
+    if (range == 0 || ((range->node.addr + range->node.pages) << 12) < end_addr) {
+        free_pool_entry(ENTRY_POOL_FREE_RANGES, spare);
         return false;
     }
 
+    take_from_free_range(space, range, addr >> 12, pages, spare);
     return true;
 }
 
@@ -424,17 +957,25 @@ bool map_allocation_to_range(AddressSpace* space, PageFrameAllocation* allocatio
 
     if (claim_virt_range(space, virt_addr, total_pages) == false) return false;
 
+    add_area(space, virt_addr, total_pages, flags, AREA_FRAMES);
+
     PageTableLocation location;
-    populate_page_table_location(space, virt_addr, &location, true);
+    reset_page_table_location(&location);
 
+    TLBGather gather;
+    init_tlb_gather(&gather, space);
+
+    // Physically contiguos runs of blocks are mapped in one go
     while (allocation != 0) {
-        const uint64_t allocation_size = get_frame_order_size(allocation->order);
-        const uint64_t pages = allocation_size / PAGE_SIZE;
-        map_range_helper(space, virt_addr, allocation->addr, pages, flags, &location);
-        allocation = allocation->next;
-        virt_addr += allocation_size;
+        const PhysicalAddress phys_addr = allocation->addr;
+        uint64_t pages;
+        allocation = get_allocation_run(allocation, &pages);
+        map_range_helper(
+            space, virt_addr, phys_addr, pages, flags | PAGING_OWNED, &location, &gather);
+        virt_addr += pages * PAGE_SIZE;
     }
 
+    flush_tlb_gather(&gather);
     return true;
 }
 
@@ -442,86 +983,489 @@ bool map_to_range(AddressSpace* space, PhysicalAddress phys_addr, VirtualAddress
                   uint64_t pages, PagingFlags flags) {
     if (claim_virt_range(space, virt_addr, pages) == false) return false;
 
+    add_area(space, virt_addr, pages, flags, AREA_PHYS);
+
     PageTableLocation location;
-    populate_page_table_location(space, virt_addr, &location, true);
+    reset_page_table_location(&location);
 
-    map_range_helper(space, virt_addr, phys_addr, pages, flags, &location);
+    TLBGather gather;
+    init_tlb_gather(&gather, space);
 
+    map_range_helper(space, virt_addr, phys_addr, pages, flags, &location, &gather);
+
+    flush_tlb_gather(&gather);
     return true;
 }
 
+// Frees the tables below a table of level which no longer map anything after [start, end) was
+// unmapped, only the tables the range went through are looked at
+void reclaim_page_tables(AddressSpace* space, PageEntry* entries, uint8_t level,
+                         VirtualAddress table_addr, VirtualAddress start, VirtualAddress end,
+                         TLBGather* gather) {
+    const uint64_t entry_size = LEVEL_ENTRY_SIZE(level);
+    const VirtualAddress table_end = table_addr + entry_size * PAGE_ENTRY_COUNT;
+
+    const uint64_t first_index = (MAX(start, table_addr) - table_addr) / entry_size;
+    const uint64_t last_index = (MIN(end, table_end) - 1 - table_addr) / entry_size;
+    for (uint64_t i = first_index; level != PT && i <= last_index; ++i) {
+        PageEntry* entry = &entries[i];
+        if (!entry->present || entry->large) continue;
+
+        PageEntry* table = get_page_entries(entry);
+        const VirtualAddress entry_addr = table_addr + i * entry_size;
+        reclaim_page_tables(space, table, level - 1, entry_addr, start, end, gather);
+        if (get_table_entry_count(table) != 0) continue;
+
+        const PhysicalAddress phys_addr = entry->phys_addr << 12;
+        entry->value = 0;
+        count_table_entry(space, entry, false);
+
+        table[0].value = gather->freed_tables;
+        gather->freed_tables = phys_addr;
+        ++gather->freed_table_count;
+    }
+}
+
+// Frees the page tables left empty by unmapping a range, once the gather is flushed
+void reclaim_range_page_tables(AddressSpace* space, VirtualAddress virt_addr, uint64_t pages,
+                               TLBGather* gather) {
+    const VirtualAddress start = virt_addr & NON_EXT_ADDR_MASK;
+    const VirtualAddress end = start + pages * PAGE_SIZE;
+
+    // The kernel PDP is shared by every PML4, so only the tables below it are freed
+    if (space == &g_kernel_space) {
+        const uint16_t pdp_index = GET_LEVEL_INDEX(start, PML4);
+        reclaim_page_tables(space,
+                            get_page_entries(&space->pml4[pdp_index]),
+                            PDP,
+                            pdp_index * LEVEL_ENTRY_SIZE(PML4),
+                            start,
+                            end,
+                            gather);
+    }
+    else {
+        reclaim_page_tables(space, space->pml4, PML4, 0, start, end, gather);
+    }
+}
+
+// Gets the pages from virt_addr to the end of the entry of level containing it, at most pages
+uint64_t get_entry_pages_left(VirtualAddress virt_addr, uint64_t pages, uint8_t level) {
+    const uint64_t size = LEVEL_ENTRY_SIZE(level);
+    return MIN(pages, (size - virt_addr % size) / PAGE_SIZE);
+}
+
 void unmap_range(AddressSpace* space, VirtualAddress virt_addr, uint64_t pages) {
-    add_range_to_free_list(space, virt_addr, pages);
+    const VirtualAddress start_virt_addr = virt_addr;
+    const uint64_t total_pages = pages;
 
     PageTableLocation location;
-    populate_page_table_location(space, virt_addr, &location, false);
+    reset_page_table_location(&location);
 
-    for (uint64_t i = 0; i < pages; ++i) {
-        page_table_traversal_helper(space, virt_addr, &location, false);
-        const uint16_t index = GET_LEVEL_INDEX(virt_addr, PT);
-        location.pt[index].value = 0;
+    TLBGather gather;
+    init_tlb_gather(&gather, space);
 
-        // Invalidate TLB entry for page belonging to virtual address
-        asm volatile("invlpg (%[virt_addr])\n" : : [virt_addr] "r"(virt_addr) : "memory");
+    while (pages != 0) {
+        uint8_t level;
+        PageEntry* entry = get_range_entry(space, virt_addr, pages, &location, &level);
+        const uint64_t entry_pages = get_entry_pages_left(virt_addr, pages, level);
 
-        virt_addr += PAGE_SIZE;
+        // Pages of user areas which were never touched aren't mapped
+        if (entry == 0 || !entry->present) {
+            KERNEL_ASSERT(space != &g_kernel_space, "Page table not present")
+        }
+        else {
+            entry->value = 0;
+            count_table_entry(space, entry, false);
+            tlb_gather_add(&gather, virt_addr, entry_pages * PAGE_SIZE);
+        }
+
+        virt_addr += entry_pages * PAGE_SIZE;
+        pages -= entry_pages;
     }
+
+    reclaim_range_page_tables(space, start_virt_addr, total_pages, &gather);
+    flush_tlb_gather(&gather);
+
+    // The range is only handed out again once nothing maps it
+    remove_areas(space, start_virt_addr, total_pages);
+    free_addr_space(space, start_virt_addr, total_pages);
 }
 
 void unmap_and_free_frames(AddressSpace* space, VirtualAddress virt_addr, uint64_t pages) {
-    add_range_to_free_list(space, virt_addr, pages);
+    const VirtualAddress start_virt_addr = virt_addr;
+    const uint64_t total_pages = pages;
 
     PageTableLocation location;
-    populate_page_table_location(space, virt_addr, &location, false);
+    reset_page_table_location(&location);
 
-    PhysicalAddress start_phys_addr;
-    PhysicalAddress curr_phys_addr;
-    PhysicalAddress frame_pages = 0;
-    for (uint64_t i = 0; i < pages; ++i) {
-        page_table_traversal_helper(space, virt_addr, &location, false);
-        const uint16_t index = GET_LEVEL_INDEX(virt_addr, PT);
+    TLBGather gather;
+    init_tlb_gather(&gather, space);
 
-        if (frame_pages == 0) {
-            start_phys_addr = curr_phys_addr = (location.pt[index].phys_addr << 12);
-            frame_pages = 1;
+    // Frames are freed in physically contiguous runs,
+    // each run is flushed from the TLB before its frames can be reused
+    PhysicalAddress start_phys_addr = 0;
+    PhysicalAddress frame_pages = 0;
+    while (pages != 0) {
+        uint8_t level;
+        PageEntry* entry = get_range_entry(space, virt_addr, pages, &location, &level);
+        const uint64_t entry_pages = get_entry_pages_left(virt_addr, pages, level);
+
+        // Pages of user areas which were never touched aren't mapped
+        if (entry == 0 || !entry->present) {
+            KERNEL_ASSERT(space != &g_kernel_space, "Page table not present")
+
+            virt_addr += entry_pages * PAGE_SIZE;
+            pages -= entry_pages;
+            continue;
         }
-        else {
-            curr_phys_addr += PAGE_SIZE;
 
-            if (curr_phys_addr != (location.pt[index].phys_addr << 12) ||
-                frame_pages * PAGE_SIZE >= get_frame_order_size(FRAME_ORDERS - 1)) {
-                KERNEL_ASSERT(__builtin_popcountll(frame_pages) == 1,
-                              "Allocation is not power of 2")
-                free_frames_contiguos(start_phys_addr, frame_pages);
-                frame_pages = 0;
+        const PhysicalAddress phys_addr = entry->phys_addr << 12;
+        const bool owned = entry->owned;
+
+        entry->value = 0;
+        count_table_entry(space, entry, false);
+        tlb_gather_add(&gather, virt_addr, entry_pages * PAGE_SIZE);
+
+        // Only frames allocated for the mapping are freed, not physical ranges mapped into it.
+        // Frames another address space still maps after a fork only lose an owner
+        for (uint64_t i = 0; owned && i < entry_pages; ++i) {
+            const PhysicalAddress frame_addr = phys_addr + i * PAGE_SIZE;
+            if (get_frame_owners(frame_addr) > 1) {
+                remove_frame_owner(frame_addr);
+                continue;
             }
-            else {
-                ++frame_pages;
+
+            if (frame_pages != 0 && start_phys_addr + frame_pages * PAGE_SIZE != frame_addr) {
+                flush_tlb_gather(&gather);
+                free_frame_range(start_phys_addr, frame_pages);
+                frame_pages = 0;
             }
+
+            if (frame_pages == 0) start_phys_addr = frame_addr;
+            ++frame_pages;
+        }
+
+        virt_addr += entry_pages * PAGE_SIZE;
+        pages -= entry_pages;
+    }
+
+    reclaim_range_page_tables(space, start_virt_addr, total_pages, &gather);
+    flush_tlb_gather(&gather);
+    if (frame_pages != 0) free_frame_range(start_phys_addr, frame_pages);
+
+    remove_areas(space, start_virt_addr, total_pages);
+    free_addr_space(space, start_virt_addr, total_pages);
+}
+
+VirtualAddress reserve_area(AddressSpace* space, uint64_t pages, PagingFlags flags) {
+    KERNEL_ASSERT(space != &g_kernel_space, "Kernel memory is never demand paged")
+
+    const VirtualAddress virt_addr = alloc_addr_space(space, pages, 0);
+    add_area(space, virt_addr, pages, flags, AREA_ZEROED);
+    return virt_addr;
+}
+
+// Gets the entry mapping virt_addr without splitting large pages
+// Returns 0 if the address isn't mapped
+PageEntry* get_leaf_entry(AddressSpace* space, VirtualAddress virt_addr) {
+    PageEntry* entry = &space->pml4[GET_LEVEL_INDEX(virt_addr, PML4)];
+    for (uint8_t level = PDP;; --level) {
+        if (!entry->present) return 0;
+
+        entry = &get_page_entries(entry)[GET_LEVEL_INDEX(virt_addr, level)];
+        if (level == PT || entry->large) return entry->present ? entry : 0;
+    }
+}
+
+// Gives the address space its own copy of a copy on write page, or makes the page writable
+// if no other address space shares its frame any longer
+bool copy_on_write_page(AddressSpace* space, VirtualAddress virt_addr) {
+    // Only user pages are ever copy on write, the kernel half is shared by every address space
+    if (virt_addr >= USER_PML4_COUNT * PDP_MEM_RANGE) return false;
+
+    // Checked before large pages are split, so only copy on write pages are ever split
+    const PageEntry* leaf_entry = get_leaf_entry(space, virt_addr);
+    if (leaf_entry == 0 || !leaf_entry->copy_on_write) return false;
+
+    PageTableLocation location;
+    reset_page_table_location(&location);
+
+    // Large pages are split so that only the written page is copied
+    uint8_t level;
+    PageEntry* entry = get_range_entry(space, virt_addr & ~(PAGE_SIZE - 1), 1, &location, &level);
+    KERNEL_ASSERT(entry != 0 && entry->present, "Copy on write page isn't mapped")
+
+    const PhysicalAddress phys_addr = entry->phys_addr << 12;
+    if (get_frame_owners(phys_addr) > 1) {
+        PageFrameAllocation* allocation = alloc_frames(1, FRAME_MOVABLE);
+        if (allocation == 0) return false;
+
+        const PhysicalAddress new_phys_addr = allocation->addr;
+        free_frame_allocation_entries(allocation);
+
+        memcpy((void*)PHYS_TO_DIRECT_MAP(new_phys_addr),
+               (const void*)PHYS_TO_DIRECT_MAP(phys_addr),
+               PAGE_SIZE);
+
+        remove_frame_owner(phys_addr);
+        entry->phys_addr = new_phys_addr >> 12;
+    }
+
+    entry->write = true;
+    entry->copy_on_write = false;
+
+    TLBGather gather;
+    init_tlb_gather(&gather, space);
+    tlb_gather_add(&gather, virt_addr & ~(PAGE_SIZE - 1), PAGE_SIZE);
+    flush_tlb_gather(&gather);
+    return true;
+}
+
+// Maps the page at virt_addr of an area, together with the pages around it
+bool map_area_pages(AddressSpace* space, VirtualAddress virt_addr, bool write) {
+    // Pages of the other areas are mapped together with the area
+    const MemoryArea* area = find_area(space, virt_addr);
+    if (area == 0 || area->backing != AREA_ZEROED) return false;
+    if (write && (area->flags & PAGING_WRITABLE) == 0) return false;
+
+    const VirtualAddress page_addr = virt_addr & ~(PAGE_SIZE - 1);
+    const VirtualAddress area_addr = area->node.addr << 12;
+
+    // The window is aligned so that access growing both upwards and downwards is covered
+    const VirtualAddress window_addr = page_addr & ~(FAULT_AROUND_PAGES * PAGE_SIZE - 1);
+    const VirtualAddress window_start = MAX(window_addr, area_addr);
+    const VirtualAddress window_end =
+        MIN(window_addr + FAULT_AROUND_PAGES * PAGE_SIZE, area_addr + area->node.pages * PAGE_SIZE);
+
+    // Pages which aren't mapped yet next to the faulting page are mapped with it
+    PhysicalAddress phys_addr;
+    VirtualAddress start = page_addr;
+    while (start != window_start && !virt_to_phys_addr(space, start - PAGE_SIZE, &phys_addr)) {
+        start -= PAGE_SIZE;
+    }
+
+    VirtualAddress end = page_addr + PAGE_SIZE;
+    while (end != window_end && !virt_to_phys_addr(space, end, &phys_addr)) end += PAGE_SIZE;
+
+    // Only the faulting page is needed when memory is short
+    PageFrameAllocation* allocation =
+        alloc_frames((end - start) / PAGE_SIZE, FRAME_ZEROED | FRAME_MOVABLE);
+    if (allocation == 0) {
+        start = page_addr;
+        end = page_addr + PAGE_SIZE;
+        allocation = alloc_frames(1, FRAME_ZEROED | FRAME_MOVABLE);
+        if (allocation == 0) return false;
+    }
+
+    PageTableLocation location;
+    reset_page_table_location(&location);
+
+    // The pages weren't present so nothing is gathered to be flushed
+    TLBGather gather;
+    init_tlb_gather(&gather, space);
+
+    PageFrameAllocation* curr_allocation = allocation;
+    while (curr_allocation != 0) {
+        const PhysicalAddress run_phys_addr = curr_allocation->addr;
+        uint64_t pages;
+        curr_allocation = get_allocation_run(curr_allocation, &pages);
+        map_range_helper(
+            space, start, run_phys_addr, pages, area->flags | PAGING_OWNED, &location, &gather);
+        start += pages * PAGE_SIZE;
+    }
+
+    flush_tlb_gather(&gather);
+    free_frame_allocation_entries(allocation);
+    return true;
+}
+
+bool handle_page_fault(VirtualAddress virt_addr, bool present, bool write, bool user) {
+    // Kernel memory is never demand paged, faults on it are kernel bugs
+    // or user access to memory it can't reach
+    if (virt_addr >= USER_PML4_COUNT * PDP_MEM_RANGE) return false;
+
+    AddressSpace* space = g_tlb.active;
+    KERNEL_ASSERT(!user || space != 0, "User mode fault without a user address space")
+    if (space == 0) return false;
+
+    if (present) return write && copy_on_write_page(space, virt_addr);
+    return map_area_pages(space, virt_addr, write);
+}
+
+bool write_to_address_space(AddressSpace* space, VirtualAddress virt_addr, const void* data,
+                            uint64_t size) {
+    while (size != 0) {
+        const uint64_t bytes = MIN(size, PAGE_SIZE - (virt_addr & (PAGE_SIZE - 1)));
+
+        // Pages are made present and private like a write from the address space would
+        PhysicalAddress phys_addr;
+        if (!virt_to_phys_addr(space, virt_addr, &phys_addr)) {
+            if (!map_area_pages(space, virt_addr, true)) return false;
         }
 
-        location.pt[index].value = 0;
+        copy_on_write_page(space, virt_addr);
+        virt_to_phys_addr(space, virt_addr, &phys_addr);
+        memcpy((void*)PHYS_TO_DIRECT_MAP(phys_addr), data, bytes);
 
-        // Invalidate TLB entry for page belonging to virtual address
-        asm volatile("invlpg (%[virt_addr])\n" : : [virt_addr] "r"(virt_addr) : "memory");
+        virt_addr += bytes;
+        data += bytes;
+        size -= bytes;
+    }
+
+    return true;
+}
 
-        virt_addr += PAGE_SIZE;
+// Gives the new address space its own writable copy of a page of the parent
+void copy_page_entry(PageEntry* parent_entry, PageEntry* entry) {
+    PageFrameAllocation* allocation = alloc_frames(1, FRAME_MOVABLE);
+    KERNEL_ASSERT(allocation != 0, "Out of memory")
+
+    const PhysicalAddress phys_addr = allocation->addr;
+    free_frame_allocation_entries(allocation);
+
+    memcpy((void*)PHYS_TO_DIRECT_MAP(phys_addr),
+           (const void*)PHYS_TO_DIRECT_MAP(parent_entry->phys_addr << 12),
+           PAGE_SIZE);
+
+    entry->value = parent_entry->value;
+    entry->phys_addr = phys_addr >> 12;
+    entry->write = parent_entry->write || parent_entry->copy_on_write;
+    entry->copy_on_write = false;
+}
+
+// Copies a leaf entry of the parent, owned frames are shared and writable ones copy on write.
+// Owned pages in stack_area are copied instead, the kernel runs on them and can't let them fault
+void fork_page_entry(PageEntry* parent_entry, PageEntry* entry, uint8_t level,
+                     VirtualAddress virt_addr, const MemoryArea* stack_area, TLBGather* gather) {
+    const uint64_t page = virt_addr >> 12;
+    if (parent_entry->owned && stack_area != 0 && page >= stack_area->node.addr &&
+        page < stack_area->node.addr + stack_area->node.pages) {
+        KERNEL_ASSERT(level == PT, "Stack pages weren't split before forking")
+        copy_page_entry(parent_entry, entry);
+        return;
     }
 
-    if (frame_pages != 0) {
-        KERNEL_ASSERT(__builtin_popcountll(frame_pages) == 1, "Allocation is not power of 2")
-        free_frames_contiguos(start_phys_addr, frame_pages);
+    if (parent_entry->owned) {
+        // Owners are counted per frame, so large pages can be split and copied a page at a time
+        const uint64_t size = LEVEL_ENTRY_SIZE(level);
+        const PhysicalAddress phys_addr = (parent_entry->phys_addr << 12) & ~(size - 1);
+        for (uint64_t offset = 0; offset < size; offset += PAGE_SIZE) {
+            add_frame_owner(phys_addr + offset);
+        }
+
+        if (parent_entry->write) {
+            parent_entry->write = false;
+            parent_entry->copy_on_write = true;
+            tlb_gather_add(gather, virt_addr, size);
+        }
     }
+
+    entry->value = parent_entry->value;
+}
+
+// Copies a table of level of the parent into a new table, returns its physical address
+PhysicalAddress fork_page_table(AddressSpace* space, PageEntry* parent_entries, uint8_t level,
+                                VirtualAddress virt_addr, const MemoryArea* stack_area,
+                                TLBGather* gather) {
+    PhysicalAddress phys_addr;
+    PageEntry* entries = alloc_page_entries(&phys_addr);
+
+    for (uint16_t i = 0; i < PAGE_ENTRY_COUNT; ++i) {
+        PageEntry* parent_entry = &parent_entries[i];
+        if (!parent_entry->present) continue;
+
+        const VirtualAddress entry_virt_addr = virt_addr + i * LEVEL_ENTRY_SIZE(level);
+        if (level == PT || parent_entry->large) {
+            fork_page_entry(parent_entry, &entries[i], level, entry_virt_addr, stack_area, gather);
+        }
+        else {
+            const PhysicalAddress table_phys_addr = fork_page_table(space,
+                                                                    get_page_entries(parent_entry),
+                                                                    level - 1,
+                                                                    entry_virt_addr,
+                                                                    stack_area,
+                                                                    gather);
+            set_table_entry(space, &entries[i], table_phys_addr);
+        }
+    }
+
+    // Every present entry of the parent is copied
+    set_frame_table_entries(phys_addr, get_table_entry_count(parent_entries));
+    return phys_addr;
+}
+
+void fork_address_space(AddressSpace* space, AddressSpace* parent, VirtualAddress stack_addr) {
+    KERNEL_ASSERT(parent != &g_kernel_space, "Can't fork the kernel address space")
+
+    new_address_space(space, parent->prot);
+    space->current_address = parent->current_address;
+    space->free_ranges = (FreeRange*)copy_address_tree(
+        (AddressNode*)parent->free_ranges, ENTRY_POOL_FREE_RANGES, sizeof(FreeRange));
+    space->areas = (MemoryArea*)copy_address_tree(
+        (AddressNode*)parent->areas, ENTRY_POOL_MEMORY_AREAS, sizeof(MemoryArea));
+
+    TLBGather gather;
+    init_tlb_gather(&gather, parent);
+
+    // The stack the kernel runs on isn't shared, a copy on write fault on it could hit in the
+    // middle of an allocation and re-enter the allocator. Large pages on it are split first so
+    // that it's copied a page at a time, a kernel stack has no area and nothing to copy
+    const MemoryArea* stack_area = 0;
+    if (stack_addr < USER_PML4_COUNT * PDP_MEM_RANGE) stack_area = find_area(parent, stack_addr);
+    if (stack_area != 0) {
+        PageTableLocation location;
+        reset_page_table_location(&location);
+
+        const VirtualAddress start_addr = stack_area->node.addr << 12;
+        for (uint64_t i = 0; i < stack_area->node.pages; ++i) {
+            uint8_t level;
+            get_range_entry(parent, start_addr + i * PAGE_SIZE, 1, &location, &level);
+        }
+
+        tlb_gather_add(&gather, start_addr, stack_area->node.pages * PAGE_SIZE);
+    }
+
+    for (uint16_t pdp_index = 0; pdp_index < USER_PML4_COUNT; ++pdp_index) {
+        const PageEntry* pml4_entry = &parent->pml4[pdp_index];
+        if (!pml4_entry->present) continue;
+
+        const PhysicalAddress phys_addr = fork_page_table(space,
+                                                          get_page_entries(pml4_entry),
+                                                          PDP,
+                                                          pdp_index * LEVEL_ENTRY_SIZE(PML4),
+                                                          stack_area,
+                                                          &gather);
+        set_table_entry(space, &space->pml4[pdp_index], phys_addr);
+    }
+
+    // Writes of the parent to its shared pages fault from here on
+    flush_tlb_gather(&gather);
 }
 
 bool virt_to_phys_addr(AddressSpace* space, VirtualAddress virt_addr, PhysicalAddress* phys_addr) {
+    const uint16_t pdp_index = GET_LEVEL_INDEX(virt_addr, PML4);
+    if (space->pml4[pdp_index].present == false) return false;
+
     const uint16_t pd_index = GET_LEVEL_INDEX(virt_addr, PDP);
-    const PageEntry* pd = get_page_entries(space, &space->pdp[pd_index], PD);
-    if (pd == 0) return false;
+    const PageEntry* pdp_entry = &get_page_entries(&space->pml4[pdp_index])[pd_index];
+    if (pdp_entry->present == false) return false;
+
+    if (pdp_entry->large) {
+        *phys_addr = (pdp_entry->phys_addr << 12) | (virt_addr & (LEVEL_ENTRY_SIZE(PDP) - 1));
+        return true;
+    }
+
+    const PageEntry* pd = get_page_entries(pdp_entry);
 
     const uint16_t pt_index = GET_LEVEL_INDEX(virt_addr, PD);
-    const PageEntry* pt = get_page_entries(space, &pd[pt_index], PT);
-    if (pt == 0) return false;
+    if (pd[pt_index].present == false) return false;
+
+    if (pd[pt_index].large) {
+        *phys_addr = (pd[pt_index].phys_addr << 12) | (virt_addr & (LEVEL_ENTRY_SIZE(PD) - 1));
+        return true;
+    }
+
+    const PageEntry* pt = get_page_entries(&pd[pt_index]);
 
     const uint16_t index = GET_LEVEL_INDEX(virt_addr, PT);
     if (pt[index].present == false) return false;
@@ -532,22 +1476,167 @@ bool virt_to_phys_addr(AddressSpace* space, VirtualAddress virt_addr, PhysicalAd
 
 bool range_set_flags(AddressSpace* space, VirtualAddress virt_addr, uint64_t pages,
                      PagingFlags flags) {
+    // Every page of a user address space in use is in an area, mapped or not
+    const bool user_space = space != &g_kernel_space;
+    if (user_space && !set_area_flags(space, virt_addr, pages, flags)) return false;
+
     PageTableLocation location;
-    populate_page_table_location(space, virt_addr, &location, false);
+    reset_page_table_location(&location);
 
-    for (uint64_t i = 0; i < pages; ++i) {
-        page_table_traversal_helper(space, virt_addr, &location, false);
+    TLBGather gather;
+    init_tlb_gather(&gather, space);
 
-        const uint16_t index = GET_LEVEL_INDEX(virt_addr, PT);
+    bool success = true;
+    while (pages != 0) {
+        uint8_t level;
+        PageEntry* entry = get_range_entry(space, virt_addr, pages, &location, &level);
+        const uint64_t entry_pages = get_entry_pages_left(virt_addr, pages, level);
 
-        if (location.pt[index].present == false) return false;
+        if (entry == 0 || entry->present == false) {
+            if (!user_space) {
+                success = false;
+                break;
+            }
+
+            // Pages which aren't touched yet are mapped with the flags of their area
+            virt_addr += entry_pages * PAGE_SIZE;
+            pages -= entry_pages;
+            continue;
+        }
 
-        set_flags(&location.pt[index], flags);
+        set_flags(entry, flags);
 
-        virt_addr += PAGE_SIZE;
+        // Shared pages stay read only until they are copied
+        if (entry->copy_on_write) {
+            entry->copy_on_write = entry->write;
+            entry->write = false;
+        }
+
+        tlb_gather_add(&gather, virt_addr, entry_pages * PAGE_SIZE);
+        virt_addr += entry_pages * PAGE_SIZE;
+        pages -= entry_pages;
     }
 
-    return true;
+    // Entries changed before a missing page was found are flushed too
+    flush_tlb_gather(&gather);
+    return success;
+}
+
+typedef void (*MappedPageCallback)(PageEntry* entry, VirtualAddress virt_addr, void* data);
+
+// Calls callback for every present 4KiB page in the user half of the address space
+// Large pages are skipped, their frames are already physically contiguous and are never moved
+void for_each_mapped_page(AddressSpace* space, MappedPageCallback callback, void* data) {
+    for (uint16_t pdp_index = 0; pdp_index < USER_PML4_COUNT; ++pdp_index) {
+        if (!space->pml4[pdp_index].present) continue;
+
+        PageEntry* pdp = get_page_entries(&space->pml4[pdp_index]);
+        for (uint16_t pd_index = 0; pd_index < PAGE_ENTRY_COUNT; ++pd_index) {
+            if (!pdp[pd_index].present || pdp[pd_index].large) continue;
+
+            PageEntry* pd = get_page_entries(&pdp[pd_index]);
+            for (uint16_t pt_index = 0; pt_index < PAGE_ENTRY_COUNT; ++pt_index) {
+                if (!pd[pt_index].present || pd[pt_index].large) continue;
+
+                PageEntry* pt = get_page_entries(&pd[pt_index]);
+                for (uint16_t index = 0; index < PAGE_ENTRY_COUNT; ++index) {
+                    if (!pt[index].present) continue;
+
+                    const VirtualAddress virt_addr =
+                        pdp_index * PDP_MEM_RANGE + pd_index * PD_MEM_RANGE +
+                        pt_index * PT_MEM_RANGE + index * PAGE_SIZE;
+                    callback(&pt[index], virt_addr, data);
+                }
+            }
+        }
+    }
+}
+
+typedef struct {
+    TLBGather gather;
+
+    PhysicalAddress block_addr;
+    uint64_t block_size;
+
+    // Frames the pages in the block are moved to
+    PageFrameAllocation* dest;
+    uint64_t dest_offset;
+
+    uint64_t moved_pages;
+} CompactionState;
+
+void mark_compaction_page(PageEntry* entry,
+                          VirtualAddress virt_addr __attribute__((unused)),
+                          void* data __attribute__((unused))) {
+    mark_compaction_frame(entry->phys_addr << 12);
+}
+
+void unmark_compaction_page(PageEntry* entry,
+                            VirtualAddress virt_addr __attribute__((unused)),
+                            void* data __attribute__((unused))) {
+    unmark_compaction_frame(entry->phys_addr << 12);
+}
+
+void migrate_compaction_page(PageEntry* entry, VirtualAddress virt_addr, void* data) {
+    CompactionState* state = (CompactionState*)data;
+
+    const PhysicalAddress phys_addr = entry->phys_addr << 12;
+    if (!range_contains(phys_addr, state->block_addr, state->block_size)) return;
+
+    KERNEL_ASSERT(state->dest != 0, "Out of compaction frames")
+    const PhysicalAddress new_phys_addr = state->dest->addr + state->dest_offset;
+    state->dest_offset += PAGE_SIZE;
+    if (state->dest_offset == get_frame_order_size(state->dest->order)) {
+        state->dest = state->dest->next;
+        state->dest_offset = 0;
+    }
+
+    memcpy((void*)PHYS_TO_DIRECT_MAP(new_phys_addr),
+           (void*)PHYS_TO_DIRECT_MAP(phys_addr),
+           PAGE_SIZE);
+
+    entry->phys_addr = new_phys_addr >> 12;
+    tlb_gather_add(&state->gather, virt_addr, PAGE_SIZE);
+
+    ++state->moved_pages;
+}
+
+uint64_t compact_address_space(AddressSpace* space, uint8_t order) {
+    KERNEL_ASSERT(space != &g_kernel_space, "Kernel pages can't be moved")
+
+    // Frames sitting in the frame caches would keep blocks from being picked
+    drain_frame_caches();
+
+    for_each_mapped_page(space, &mark_compaction_page, 0);
+
+    CompactionState state = {0};
+    init_tlb_gather(&state.gather, space);
+    uint64_t marked_frames;
+    if (!isolate_compaction_block(order, &state.block_addr, &marked_frames)) {
+        for_each_mapped_page(space, &unmark_compaction_page, 0);
+        return 0;
+    }
+    state.block_size = get_frame_order_size(order);
+
+    // Frames are allocated up front so that running out of memory leaves every page in place
+    PageFrameAllocation* allocation = alloc_frames(marked_frames, FRAME_MOVABLE);
+    if (allocation == 0) {
+        release_compaction_block(state.block_addr, order, false);
+        for_each_mapped_page(space, &unmark_compaction_page, 0);
+        return 0;
+    }
+
+    state.dest = allocation;
+    for_each_mapped_page(space, &migrate_compaction_page, &state);
+    free_frame_allocation_entries(allocation);
+
+    // The old frames are only given back once no TLB entry points at them
+    flush_tlb_gather(&state.gather);
+
+    release_compaction_block(state.block_addr, order, true);
+    for_each_mapped_page(space, &unmark_compaction_page, 0);
+
+    return state.moved_pages;
 }
 
 VirtualAddress kmap_allocation(PageFrameAllocation* allocation, PagingFlags flags) {
@@ -562,6 +1651,10 @@ void kunmap_range(VirtualAddress virt_addr, uint64_t pages) {
     unmap_range(&g_kernel_space, virt_addr, pages);
 }
 
+void kzero_phys_range(PhysicalAddress phys_addr, uint64_t pages) {
+    memset((void*)PHYS_TO_DIRECT_MAP(phys_addr), 0, pages * PAGE_SIZE);
+}
+
 void kunmap_and_free_frames(VirtualAddress virt_addr, uint64_t pages) {
     unmap_and_free_frames(&g_kernel_space, virt_addr, pages);
 }
@@ -570,6 +1663,18 @@ bool kvirt_to_phys_addr(VirtualAddress virt_addr, PhysicalAddress* phys_addr) {
     return virt_to_phys_addr(&g_kernel_space, virt_addr, phys_addr);
 }
 
+// Checks if a memory map region is RAM which has to be reachable through the direct map
+bool is_direct_map_memory(uint32_t type) {
+    switch (type) {
+        case EfiReservedMemoryType:
+        case EfiUnusableMemory:
+        case EfiMemoryMappedIO:
+        case EfiMemoryMappedIOPortSpace:
+        case EfiPalCode: return false;
+        default: return true;
+    }
+}
+
 void free_uefi_memory_and_remove_identity_mapping(void* uefi_memory_map) {
     // Free UEFI memory
     {
@@ -593,7 +1698,14 @@ void free_uefi_memory_and_remove_identity_mapping(void* uefi_memory_map) {
                         KERNEL_ASSERT(order < FRAME_ORDERS, "Order does not exist")
 
                         const uint64_t order_size = get_frame_order_size(order);
-                        free_frames_contiguos(phys_addr, order_size / PAGE_SIZE);
+
+                        // Memory left behind by UEFI isn't in the processor caches
+                        if (order == 0) {
+                            free_frame(phys_addr, true);
+                        }
+                        else {
+                            free_frames_contiguos(phys_addr, order_size / PAGE_SIZE);
+                        }
                         size -= order_size;
                         phys_addr += order_size;
                     }
@@ -605,22 +1717,21 @@ void free_uefi_memory_and_remove_identity_mapping(void* uefi_memory_map) {
     }
 
     // Clear idenity mapping
-    for (uint64_t i = 0; i < KERNEL_PML4_OFFSET; ++i) g_pml4[i].value = 0;
+    for (uint64_t i = 0; i < DIRECT_MAP_PML4_OFFSET; ++i) g_pml4[i].value = 0;
 
-    // Refresh TLB
-    asm volatile("mov %%cr3, %%rax\n"
-                 "mov %%rax, %%cr3\n"
-                 :
-                 :
-                 : "rax", "cr3", "memory");
+    flush_tlb_global();
 }
 
 VirtualAddress initialize_paging(void* uefi_memory_map, PhysicalAddress kernel_phys_addr,
                                  uint64_t kernel_size) {
     _Static_assert(KERNEL_PML4_OFFSET < PAGE_ENTRY_COUNT, "Kernel PML4 offset is out of bounds");
     _Static_assert(sizeof(PageEntry) == 8, "PageEntry is not 8 bytes");
-    _Static_assert(sizeof(FreeListEntry) == 16, "FreeListEntry struct not 16 bytes");
-    _Static_assert(sizeof(MappingEntry) == 16, "MappingEntry struct not 16 bytes");
+    _Static_assert(sizeof(FreeRange) == 2 * ENTRY_SIZE, "FreeRange struct not 32 bytes");
+    _Static_assert(sizeof(MemoryArea) == 2 * ENTRY_SIZE, "MemoryArea struct not 32 bytes");
+    _Static_assert(DIRECT_MAP_PML4_OFFSET < KERNEL_PML4_OFFSET,
+                   "Direct map overlaps with kernel address space");
+    _Static_assert(USER_PML4_COUNT <= DIRECT_MAP_PML4_OFFSET,
+                   "Direct map overlaps with user address spaces");
 
     // Check for NX bit with CPUID
     {
@@ -632,6 +1743,23 @@ VirtualAddress initialize_paging(void* uefi_memory_map, PhysicalAddress kernel_p
                      : "rax", "rbx", "rcx", "memory", "cc");
 
         g_paging_execute_disable = ((edx >> 20) & 1) != 0;
+
+        // 2MiB pages are always supported in long mode, 1GiB pages are optional
+        g_paging_1gb_pages = ((edx >> 26) & 1) != 0;
+    }
+
+    // Check for PCID and global pages with CPUID
+    {
+        uint32_t ecx;
+        uint32_t edx;
+        asm volatile("mov $1, %%eax\n"
+                     "cpuid\n"
+                     : "=c"(ecx), "=d"(edx)
+                     :
+                     : "rax", "rbx", "memory", "cc");
+
+        g_paging_pcid = ((ecx >> 17) & 1) != 0;
+        g_paging_global = ((edx >> 13) & 1) != 0;
     }
 
     struct {
@@ -644,29 +1772,35 @@ VirtualAddress initialize_paging(void* uefi_memory_map, PhysicalAddress kernel_p
                                  &frame_allocator.total_pages,
                                  &frame_allocator.entry_pool_pages);
 
-    const uint64_t frame_allocator_size = frame_allocator.total_pages * PAGE_SIZE;
+    // The direct map covers physical memory up to the end of the last RAM region with large pages,
+    // holes below that are mapped too and kept uncached by the MTRRs
+    const uint64_t direct_map_page_size = LEVEL_ENTRY_SIZE(g_paging_1gb_pages ? PDP : PD);
+    PhysicalAddress memory_end = 0;
+    {
+        const UEFIMemoryMap* memory_map = (UEFIMemoryMap*)uefi_memory_map;
+        for (uint64_t i = 0; i < memory_map->buffer_size; i += memory_map->desc_size) {
+            const UEFIMemoryDescriptor* desc = (UEFIMemoryDescriptor*)&memory_map->buffer[i];
+            if (!is_direct_map_memory(desc->type)) continue;
 
-    const uint64_t starting_pool_size = PAGE_POOL_THRESHOLD * 2 * PAGE_SIZE;
+            memory_end = MAX(memory_end, desc->physical_start + desc->num_pages * PAGE_SIZE);
+        }
+        memory_end = round_up_to_multiple(memory_end, direct_map_page_size);
+    }
 
-    const uint64_t memory_entries_size = PAGE_SIZE;
+    KERNEL_ASSERT(memory_end <= DIRECT_MAP_PML4_COUNT * PDP_MEM_RANGE,
+                  "Physical memory doesn't fit in the direct map")
 
-    const uint64_t total_size =
-        kernel_size + starting_pool_size + frame_allocator_size + memory_entries_size;
+    const uint64_t direct_map_pdp_count =
+        round_up_to_multiple(memory_end, PDP_MEM_RANGE) / PDP_MEM_RANGE;
+    const uint64_t direct_map_pd_count = g_paging_1gb_pages ? 0 : memory_end / PD_MEM_RANGE;
 
+    // Only the kernel itself is mapped into the kernel address space
     const uint64_t pdp_count = 1;
-
-    uint64_t pd_count = MAX(total_size / PD_MEM_RANGE, 1U);
-
-    // Make sure we have room to map PD entries into virtual memory
-    while ((pd_count * PD_MEM_RANGE - total_size) < pd_count * PAGE_SIZE) ++pd_count;
-
-    uint64_t pt_count = MAX(total_size / PT_MEM_RANGE, 1U);
-
-    // Make sure we have room to map PT entries into virtual memory
-    while ((pt_count * PT_MEM_RANGE - total_size) < (pt_count + pd_count) * PAGE_SIZE) ++pt_count;
+    const uint64_t pd_count = round_up_to_multiple(kernel_size, PD_MEM_RANGE) / PD_MEM_RANGE;
+    const uint64_t pt_count = round_up_to_multiple(kernel_size, PT_MEM_RANGE) / PT_MEM_RANGE;
 
     const uint64_t pages_to_allocate =
-        pdp_count + pd_count + pt_count + ((starting_pool_size + memory_entries_size) / PAGE_SIZE);
+        pdp_count + pd_count + pt_count + direct_map_pdp_count + direct_map_pd_count;
 
     KERNEL_ASSERT(pages_to_allocate * PAGE_SIZE < get_memory_size(),
                   "Memory initialization requires more memory than we have")
@@ -714,11 +1848,10 @@ VirtualAddress initialize_paging(void* uefi_memory_map, PhysicalAddress kernel_p
         }
     }
 
-    g_kernel_space.pdp = (PageEntry*)allocated_phys_addr;
+    PageEntry* kernel_pdp = (PageEntry*)allocated_phys_addr;
     allocated_phys_addr += PAGE_SIZE;
-    memset(g_kernel_space.pdp, 0, PAGE_SIZE);
 
-    g_pml4[KERNEL_PML4_OFFSET].phys_addr = (PhysicalAddress)g_kernel_space.pdp >> 12;
+    g_pml4[KERNEL_PML4_OFFSET].phys_addr = (PhysicalAddress)kernel_pdp >> 12;
     g_pml4[KERNEL_PML4_OFFSET].present = true;
     g_pml4[KERNEL_PML4_OFFSET].write = true;
 
@@ -729,9 +1862,9 @@ VirtualAddress initialize_paging(void* uefi_memory_map, PhysicalAddress kernel_p
             PageEntry* pd = (PageEntry*)allocated_phys_addr;
             allocated_phys_addr += PAGE_SIZE;
 
-            g_kernel_space.pdp[i].phys_addr = (PhysicalAddress)pd >> 12;
-            g_kernel_space.pdp[i].present = true;
-            g_kernel_space.pdp[i].write = true;
+            kernel_pdp[i].phys_addr = (PhysicalAddress)pd >> 12;
+            kernel_pdp[i].present = true;
+            kernel_pdp[i].write = true;
 
             for (uint64_t j = 0; j < MIN(curr_pt_count, 512U); ++j) {
                 pd[j].phys_addr = (PhysicalAddress)allocated_phys_addr >> 12;
@@ -744,17 +1877,61 @@ VirtualAddress initialize_paging(void* uefi_memory_map, PhysicalAddress kernel_p
         }
     }
 
+    // Populate direct map with PDPs, PDs and large pages
+    {
+        for (uint64_t i = 0; i < direct_map_pdp_count; ++i) {
+            g_pml4[DIRECT_MAP_PML4_OFFSET + i].value = 0;
+            g_pml4[DIRECT_MAP_PML4_OFFSET + i].phys_addr = allocated_phys_addr >> 12;
+            g_pml4[DIRECT_MAP_PML4_OFFSET + i].present = true;
+            g_pml4[DIRECT_MAP_PML4_OFFSET + i].write = true;
+            allocated_phys_addr += PAGE_SIZE;
+        }
+
+        for (uint64_t i = 0; i < direct_map_pd_count; ++i) {
+            const VirtualAddress virt_addr = PHYS_TO_DIRECT_MAP(i * PD_MEM_RANGE);
+            PageEntry* pdp =
+                (PageEntry*)(g_pml4[GET_LEVEL_INDEX(virt_addr, PML4)].phys_addr << 12);
+
+            PageEntry* entry = &pdp[GET_LEVEL_INDEX(virt_addr, PDP)];
+            entry->phys_addr = allocated_phys_addr >> 12;
+            entry->present = true;
+            entry->write = true;
+            allocated_phys_addr += PAGE_SIZE;
+        }
+
+        for (PhysicalAddress phys_addr = 0; phys_addr < memory_end;
+             phys_addr += direct_map_page_size) {
+            const VirtualAddress virt_addr = PHYS_TO_DIRECT_MAP(phys_addr);
+            PageEntry* pdp =
+                (PageEntry*)(g_pml4[GET_LEVEL_INDEX(virt_addr, PML4)].phys_addr << 12);
+
+            PageEntry* entry = &pdp[GET_LEVEL_INDEX(virt_addr, PDP)];
+            if (!g_paging_1gb_pages) {
+                PageEntry* pd = (PageEntry*)(entry->phys_addr << 12);
+                entry = &pd[GET_LEVEL_INDEX(virt_addr, PD)];
+            }
+
+            entry->phys_addr = phys_addr >> 12;
+            entry->present = true;
+            entry->write = true;
+            entry->large = true;
+            entry->global = true;
+            entry->execute_disable = g_paging_execute_disable;
+        }
+    }
+
 #define MAP_PAGE(_virt_addr, _phys_addr, _write, _executable)                       \
     {                                                                               \
         const uint16_t pd_index = GET_LEVEL_INDEX(_virt_addr, PDP);                 \
         const uint16_t pt_index = GET_LEVEL_INDEX(_virt_addr, PD);                  \
-        PageEntry* pd = (PageEntry*)(g_kernel_space.pdp[pd_index].phys_addr << 12); \
+        PageEntry* pd = (PageEntry*)(kernel_pdp[pd_index].phys_addr << 12);         \
         PageEntry* pt = (PageEntry*)(pd[pt_index].phys_addr << 12);                 \
                                                                                     \
         const uint16_t index = GET_LEVEL_INDEX(_virt_addr, PT);                     \
         pt[index].phys_addr = _phys_addr;                                           \
         pt[index].present = true;                                                   \
         pt[index].write = _write;                                                   \
+        pt[index].global = true;                                                    \
         pt[index].execute_disable = (!(_executable)) && g_paging_execute_disable;   \
     }
 
@@ -786,107 +1963,43 @@ VirtualAddress initialize_paging(void* uefi_memory_map, PhysicalAddress kernel_p
         }
     }
 
-    // Map memory entries into virtual memory
-    const VirtualAddress memory_entries_virt_addr = SIGN_EXT_ADDR(g_kernel_space.current_address);
-    for (uint64_t i = 0; i < memory_entries_size / PAGE_SIZE; ++i) {
-        MAP_PAGE(g_kernel_space.current_address, allocated_phys_addr >> 12, true, false)
-        g_kernel_space.current_address += PAGE_SIZE;
-        allocated_phys_addr += PAGE_SIZE;
-    }
-
     // Switch to new page table
     asm("mov %[pml4], %%cr3" : : [pml4] "r"(g_pml4) : "cr3", "memory");
 
-    fill_memory_entry_pool(memory_entries_virt_addr, memory_entries_size / PAGE_SIZE);
-
-    // Initialize page pool
+    // PCIDs can only be enabled while CR3 holds PCID 0, which the kernel keeps using until
+    // an address space is mapped
     {
-        for (uint64_t i = 0; i < starting_pool_size / PAGE_SIZE; ++i) {
-            const VirtualAddress virt_addr = SIGN_EXT_ADDR(g_kernel_space.current_address);
-            g_kernel_space.current_address += PAGE_SIZE;
-
-            MAP_PAGE(virt_addr, allocated_phys_addr >> 12, true, false)
-
-            PagePoolEntry* pool_entry = (PagePoolEntry*)get_memory_entry();
-            pool_entry->next = (VirtualAddress)g_page_pool.head;
-            pool_entry->phys_addr = allocated_phys_addr >> 12;
-            pool_entry->virt_addr = virt_addr >> 12;
-            g_page_pool.head = pool_entry;
-
-            allocated_phys_addr += PAGE_SIZE;
-        }
-
-        g_page_pool.count += starting_pool_size / PAGE_SIZE;
-    }
+        uint64_t cr4_flags = 0;
+        if (g_paging_pcid) cr4_flags |= CR4_PCIDE;
+        if (g_paging_global) cr4_flags |= CR4_PGE;
 
-    // Map frame allocator memory into virtual memory
-    const VirtualAddress frame_allocator_virt_addr = SIGN_EXT_ADDR(g_kernel_space.current_address);
-    {
-        PhysicalAddress curr_phys_addr = frame_allocator.phys_addr;
-        while (curr_phys_addr != frame_allocator.phys_addr + frame_allocator_size) {
-            const VirtualAddress virt_addr = SIGN_EXT_ADDR(g_kernel_space.current_address);
-            g_kernel_space.current_address += PAGE_SIZE;
-            MAP_PAGE(virt_addr, curr_phys_addr >> 12, true, false)
-            curr_phys_addr += PAGE_SIZE;
-        }
+        asm volatile("mov %%cr4, %%rax\n"
+                     "or %[flags], %%rax\n"
+                     "mov %%rax, %%cr4\n"
+                     :
+                     : [flags] "r"(cr4_flags)
+                     : "rax", "memory");
     }
 
-    // Map page entries into virtual memory
-    {
-        {
-            const VirtualAddress virt_addr = SIGN_EXT_ADDR(g_kernel_space.current_address);
-            g_kernel_space.current_address += PAGE_SIZE;
-
-            MAP_PAGE(virt_addr, (PhysicalAddress)g_kernel_space.pdp >> 12, true, false)
-
-            g_kernel_space.pdp = (PageEntry*)virt_addr;
-        }
-
-        uint64_t curr_pt_count = pt_count;
-        for (uint64_t i = 0; i < pd_count; ++i) {
-            // Map PD entry
-            {
-                const VirtualAddress virt_addr = SIGN_EXT_ADDR(g_kernel_space.current_address);
-                g_kernel_space.current_address += PAGE_SIZE;
-
-                MAP_PAGE(virt_addr, g_kernel_space.pdp[i].phys_addr, true, false)
-
-                MappingEntry* entry = (MappingEntry*)get_memory_entry();
-                entry->next = (VirtualAddress)g_kernel_space.entry_maps[PD];
-                entry->phys_addr = g_kernel_space.pdp[i].phys_addr;
-                entry->virt_addr = virt_addr >> 12;
-                g_kernel_space.entry_maps[PD] = entry;
-            }
-
-            // Map PT entries
-            PageEntry* pd = (PageEntry*)(g_kernel_space.pdp[i].phys_addr << 12);
-            for (uint64_t j = 0; j < MIN(curr_pt_count, 512U); ++j) {
-                const VirtualAddress virt_addr = g_kernel_space.current_address;
-                g_kernel_space.current_address += PAGE_SIZE;
-
-                MAP_PAGE(virt_addr, pd[j].phys_addr, true, false)
-
-                MappingEntry* entry = (MappingEntry*)get_memory_entry();
-                entry->next = (VirtualAddress)g_kernel_space.entry_maps[PT];
-                entry->phys_addr = pd[j].phys_addr;
-                entry->virt_addr = virt_addr >> 12;
-                g_kernel_space.entry_maps[PT] = entry;
-            }
-            curr_pt_count -= 512;
-        }
-    }
+    // Read only pages have to be read only for the kernel too, or it would write to shared frames
+    asm volatile("mov %%cr0, %%rax\n"
+                 "or %[wp], %%rax\n"
+                 "mov %%rax, %%cr0\n"
+                 :
+                 : [wp] "r"(CR0_WP)
+                 : "rax", "memory");
 
-    // Invalidate TLB to make new paging take effect
-    asm("mov %%cr3, %%rax\n"
-        "mov %%rax, %%cr3\n"
-        :
-        :
-        : "rax", "cr3", "memory");
+    // Frame allocator memory is reached through the direct map
+    const VirtualAddress frame_allocator_virt_addr = PHYS_TO_DIRECT_MAP(frame_allocator.phys_addr);
 
     initialize_frame_allocator(frame_allocator_virt_addr,
                                frame_allocator.total_pages,
                                uefi_memory_map,
                                frame_allocator.entry_pool_pages);
 
+    // The frame descriptors only exist now, the kernel tables are counted before anything
+    // is mapped or unmapped in the kernel address space
+    count_boot_table_entries(get_page_entries(&g_pml4[KERNEL_PML4_OFFSET]), PDP);
+
     return SIGN_EXT_ADDR(KERNEL_OFFSET);
 }
@@ -123,7 +123,7 @@ void* kalloc(uint64_t size) {
     else {
         // Allocate slab and owned memory
         {
-            void* mem = (void*)alloc_pages(cache->pages, PAGING_WRITABLE);
+            void* mem = (void*)alloc_reclaimable_pages(cache->pages, PAGING_WRITABLE);
             if (mem == 0) return 0;
 
             // Allocate Slab on memory if size is below threshold
@@ -0,0 +1,254 @@
+#include "numa.h"
+
+#include "acpi.h"
+#include "kassert.h"
+#include "memory/frame_allocator.h"
+
+#define PROCESSOR_AFFINITY_ENTRY 0
+#define MEMORY_AFFINITY_ENTRY 1
+#define X2APIC_AFFINITY_ENTRY 2
+
+#define AFFINITY_ENABLED 1
+
+// Only xAPIC ids are used to look up nodes, x2APIC ids above this are ignored
+#define MAX_APIC_ID 256
+
+typedef struct {
+    ACPISDTHeader header;
+    uint32_t reserved0;
+    uint64_t reserved1;
+} __attribute__((packed)) SRAT;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) SRATEntry;
+
+typedef struct {
+    SRATEntry header;
+    uint8_t proximity_domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t proximity_domain_high[3];
+    uint32_t clock_domain;
+} __attribute__((packed)) ProcessorAffinityEntry;
+
+typedef struct {
+    SRATEntry header;
+    uint32_t proximity_domain;
+    uint16_t reserved0;
+    uint64_t base;
+    uint64_t length;
+    uint32_t reserved1;
+    uint32_t flags;
+    uint64_t reserved2;
+} __attribute__((packed)) MemoryAffinityEntry;
+
+typedef struct {
+    SRATEntry header;
+    uint16_t reserved0;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved1;
+} __attribute__((packed)) X2APICAffinityEntry;
+
+typedef struct {
+    ACPISDTHeader header;
+    uint64_t locality_count;
+    uint8_t distances[];
+} __attribute__((packed)) SLIT;
+
+struct {
+    // Proximity domain of every node, nodes are numbered in the order they are found
+    uint32_t domains[MAX_NUMA_NODES];
+    uint8_t node_count;
+
+    NUMAMemoryRange memory_ranges[MAX_NUMA_MEMORY_RANGES];
+    uint64_t memory_range_count;
+
+    uint8_t distances[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+    uint8_t apic_nodes[MAX_APIC_ID];
+} g_numa = {.node_count = 1};
+
+// Gets the SLIT distance between two proximity domains, NUMA_REMOTE_DISTANCE if it isn't known
+uint8_t get_slit_distance(const SLIT* slit, uint32_t from_domain, uint32_t to_domain) {
+    if (slit == 0 || from_domain >= slit->locality_count || to_domain >= slit->locality_count) {
+        return NUMA_REMOTE_DISTANCE;
+    }
+
+    return slit->distances[from_domain * slit->locality_count + to_domain];
+}
+
+// Gets the node for a proximity domain, adding a new node if it hasn't been seen before.
+// Domains found once every node is taken are folded into the nearest node
+uint8_t get_domain_node(uint32_t domain, const SLIT* slit) {
+    for (uint8_t i = 0; i < g_numa.node_count; ++i) {
+        if (g_numa.domains[i] == domain) return i;
+    }
+
+    if (g_numa.node_count < MAX_NUMA_NODES) {
+        g_numa.domains[g_numa.node_count] = domain;
+        return g_numa.node_count++;
+    }
+
+    uint8_t nearest = 0;
+    for (uint8_t i = 1; i < g_numa.node_count; ++i) {
+        if (get_slit_distance(slit, domain, g_numa.domains[i]) <
+            get_slit_distance(slit, domain, g_numa.domains[nearest])) {
+            nearest = i;
+        }
+    }
+
+    return nearest;
+}
+
+// Adds a memory range, ranges found once the table is full are merged into the last range
+// if they continue it and are ignored otherwise, leaving their memory on the first node
+void add_numa_memory_range(PhysicalAddress base, uint64_t size, uint8_t node) {
+    if (g_numa.memory_range_count != 0) {
+        NUMAMemoryRange* last = &g_numa.memory_ranges[g_numa.memory_range_count - 1];
+        if (last->node == node && last->base + last->size == base) {
+            last->size += size;
+            return;
+        }
+    }
+
+    if (g_numa.memory_range_count == MAX_NUMA_MEMORY_RANGES) return;
+
+    NUMAMemoryRange* range = &g_numa.memory_ranges[g_numa.memory_range_count++];
+    range->base = base;
+    range->size = size;
+    range->node = node;
+}
+
+void parse_srat(const SRAT* srat, const SLIT* slit) {
+    // Nodes are added as they are found in the SRAT
+    g_numa.node_count = 0;
+
+    const void* end = (void*)srat + srat->header.length;
+    const void* curr_addr = (void*)srat + sizeof(SRAT);
+    while (curr_addr + sizeof(SRATEntry) <= end) {
+        const SRATEntry* entry_header = (const SRATEntry*)curr_addr;
+
+        // A broken entry length would never get to the end of the table
+        if (entry_header->length < sizeof(SRATEntry)) break;
+        curr_addr += entry_header->length;
+
+        switch (entry_header->type) {
+            case PROCESSOR_AFFINITY_ENTRY: {
+                const ProcessorAffinityEntry* entry = (const ProcessorAffinityEntry*)entry_header;
+                if ((entry->flags & AFFINITY_ENABLED) == 0) break;
+
+                const uint32_t domain = entry->proximity_domain_low |
+                                        (entry->proximity_domain_high[0] << 8) |
+                                        (entry->proximity_domain_high[1] << 16) |
+                                        (entry->proximity_domain_high[2] << 24);
+
+                g_numa.apic_nodes[entry->apic_id] = get_domain_node(domain, slit);
+                break;
+            }
+
+            case MEMORY_AFFINITY_ENTRY: {
+                const MemoryAffinityEntry* entry = (const MemoryAffinityEntry*)entry_header;
+                if ((entry->flags & AFFINITY_ENABLED) == 0 || entry->length == 0) break;
+
+                add_numa_memory_range(
+                    entry->base, entry->length, get_domain_node(entry->proximity_domain, slit));
+                break;
+            }
+
+            case X2APIC_AFFINITY_ENTRY: {
+                const X2APICAffinityEntry* entry = (const X2APICAffinityEntry*)entry_header;
+                if ((entry->flags & AFFINITY_ENABLED) == 0) break;
+                if (entry->x2apic_id >= MAX_APIC_ID) break;
+
+                g_numa.apic_nodes[entry->x2apic_id] =
+                    get_domain_node(entry->proximity_domain, slit);
+                break;
+            }
+
+            default: break;
+        }
+    }
+
+    // A SRAT without any enabled entries describes a single node
+    if (g_numa.node_count == 0) g_numa.node_count = 1;
+}
+
+void parse_slit(const SLIT* slit) {
+    for (uint8_t from = 0; from < g_numa.node_count; ++from) {
+        for (uint8_t to = 0; to < g_numa.node_count; ++to) {
+            const uint64_t from_domain = g_numa.domains[from];
+            const uint64_t to_domain = g_numa.domains[to];
+
+            // Domains missing from the SLIT keep their default distance
+            if (from_domain >= slit->locality_count || to_domain >= slit->locality_count) {
+                continue;
+            }
+
+            g_numa.distances[from][to] = get_slit_distance(slit, from_domain, to_domain);
+        }
+    }
+}
+
+void initialize_numa() {
+    const SRAT* srat = (const SRAT*)find_table("SRAT");
+    if (srat == 0) return;
+
+    {
+        const bool srat_valid = sdt_is_valid(&srat->header, "SRAT");
+        KERNEL_ASSERT(srat_valid, "INVALID SRAT")
+    }
+
+    // Read first so that domains beyond MAX_NUMA_NODES can be folded into the nearest node
+    const SLIT* slit = (const SLIT*)find_table("SLIT");
+    if (slit != 0) {
+        const bool slit_valid = sdt_is_valid(&slit->header, "SLIT");
+        KERNEL_ASSERT(slit_valid, "INVALID SLIT")
+    }
+
+    parse_srat(srat, slit);
+
+    for (uint8_t from = 0; from < g_numa.node_count; ++from) {
+        for (uint8_t to = 0; to < g_numa.node_count; ++to) {
+            g_numa.distances[from][to] = from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    if (slit != 0) parse_slit(slit);
+
+    // Move free memory to the free lists of the node it belongs to
+    assign_frame_numa_nodes();
+}
+
+uint8_t get_numa_node_count() { return g_numa.node_count; }
+
+uint64_t get_numa_memory_range_count() { return g_numa.memory_range_count; }
+
+const NUMAMemoryRange* get_numa_memory_range(uint64_t index) {
+    KERNEL_ASSERT(index < g_numa.memory_range_count, "NUMA memory range out of bounds")
+    return &g_numa.memory_ranges[index];
+}
+
+uint8_t get_numa_distance(uint8_t from, uint8_t to) {
+    KERNEL_ASSERT(from < g_numa.node_count && to < g_numa.node_count, "Not a NUMA node")
+
+    if (g_numa.node_count == 1) return NUMA_LOCAL_DISTANCE;
+    return g_numa.distances[from][to];
+}
+
+uint8_t get_cpu_numa_node() {
+    // The initial APIC id is in bits 24-31 of EBX
+    uint32_t ebx;
+    asm volatile("mov $1, %%eax\n"
+                 "cpuid\n"
+                 : "=b"(ebx)
+                 :
+                 : "rax", "rcx", "rdx", "memory", "cc");
+
+    return g_numa.apic_nodes[ebx >> 24];
+}
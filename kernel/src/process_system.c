@@ -55,8 +55,6 @@ void context_switch(void* rsp) {
         g_process_queue.head->context_stack_ptr = process_stack;
     }
 
-    unmap_address_space(g_process_queue.head->addr_space);
-
     Process* tmp = g_process_queue.head;
     if (tmp->next != 0) {
         g_process_queue.head = tmp->next;
@@ -136,7 +134,7 @@ Process* alloc_process_and_addr_space(uint8_t paging_prot) {
     memset(process->addr_space, 0, sizeof(AddressSpace));
 
     // Create new address space
-    new_address_space(process->addr_space, 0, paging_prot);
+    new_address_space(process->addr_space, paging_prot);
 
     return process;
 }
@@ -155,8 +153,11 @@ void start_user_process(const void* elf_data) {
     }
 
     // Allocate user stack
+    // The kernel runs on the user stack during syscalls and context switches, so it's mapped
+    // up front, a fault on it in the middle of an allocation would re-enter the allocator
     {
-        PageFrameAllocation* allocation = alloc_frames(USER_STACK_SIZE / PAGE_SIZE);
+        PageFrameAllocation* allocation =
+            alloc_frames(USER_STACK_SIZE / PAGE_SIZE, FRAME_CONTIGUOUS | FRAME_MOVABLE);
         process->context_stack_ptr =
             (void*)map_allocation(process->addr_space, allocation, PAGING_WRITABLE) +
             USER_STACK_SIZE - USER_STACK_SAVE_SIZE;
@@ -175,8 +176,56 @@ void start_user_process(const void* elf_data) {
         rspu64[19] = GDT_USER_DATA_SEGMENT | 3;            // ss
     }
 
+    // Switch back to the address space of the process which started the new one
+    map_address_space(g_process_queue.head->addr_space);
+
+    g_process_queue.tail->next = process;
+    g_process_queue.tail = process;
+}
+
+uint64_t fork_current_process(const uint64_t* regs) {
+    Process* parent = g_process_queue.head;
+
+    Process* process = kalloc(sizeof(Process));
+    memset(process, 0, sizeof(Process));
+    process->pid = generate_pid();
+
+    process->addr_space = kalloc(sizeof(AddressSpace));
+    // regs is on the stack of the parent, which the kernel is running on
+    fork_address_space(process->addr_space, parent->addr_space, (VirtualAddress)regs);
+
+    // regs holds r15, r14, r13, r12, rbx, the return address of the syscall,
+    // then rbp, r11 (rflags), rcx (rip) and rsp pushed by the syscall dispatcher
+    const uint64_t user_rsp = regs[9];
+
+    // The kernel runs on the stack of the parent, whose pages the new process sees as they were
+    // when it was forked, so the new process is never mapped here
+    uint64_t state[USER_STACK_SAVE_SIZE / sizeof(uint64_t)] = {0};
+    state[0] = regs[0];                    // r15
+    state[1] = regs[1];                    // r14
+    state[2] = regs[2];                    // r13
+    state[3] = regs[3];                    // r12
+    state[8] = regs[6];                    // rbp
+    state[13] = regs[4];                   // rbx
+    state[14] = 0;                         // rax, fork returns 0 in the new process
+    state[15] = regs[8];                   // rip
+    state[16] = GDT_USER_CODE_SEGMENT | 3; // cs
+    state[17] = regs[7];                   // rflags
+    state[18] = user_rsp;                  // rsp
+    state[19] = GDT_USER_DATA_SEGMENT | 3; // ss
+
+    // The register state is put below the stack pointer of the new process
+    process->context_stack_ptr = (void*)(user_rsp - USER_STACK_SAVE_SIZE);
+    {
+        const bool success = write_to_address_space(
+            process->addr_space, user_rsp - USER_STACK_SAVE_SIZE, state, USER_STACK_SAVE_SIZE);
+        KERNEL_ASSERT(success, "User stack isn't mapped")
+    }
+
     g_process_queue.tail->next = process;
     g_process_queue.tail = process;
+
+    return process->pid;
 }
 
 void initialize_process_system() {
@@ -220,7 +269,8 @@ void initialize_process_system() {
 
     // Allocate process stack
     {
-        PageFrameAllocation* allocation = alloc_frames(USER_STACK_SIZE / PAGE_SIZE);
+        PageFrameAllocation* allocation =
+            alloc_frames(USER_STACK_SIZE / PAGE_SIZE, FRAME_CONTIGUOUS | FRAME_MOVABLE);
         process->context_stack_ptr =
             (void*)map_allocation(process->addr_space, allocation, PAGING_WRITABLE) +
             USER_STACK_SIZE;
@@ -13,7 +13,7 @@
 #include <string.h>
 
 // Number of entries in the syscall table, can be increased when needed
-#define NUM_SYSCALLS 5
+#define NUM_SYSCALLS 6
 
 void* g_syscall_table[NUM_SYSCALLS];
 
@@ -85,14 +85,31 @@ void syscall_get_framebuffer(Framebuffer* fb) {
 }
 
 void* syscall_alloc_pages(uint64_t pages) {
-    PageFrameAllocation* allocation = alloc_frames(pages);
-    if (allocation == 0) return 0;
+    if (pages == 0) return 0;
 
+    // Memory is allocated when the pages are first touched
     AddressSpace* userspace = get_current_process_addr_space();
-    void* ptr = (void*)map_allocation(userspace, allocation, PAGING_WRITABLE);
+    return (void*)reserve_area(userspace, pages, PAGING_WRITABLE);
+}
 
-    free_frame_allocation_entries(allocation);
-    return ptr;
+// Hands the callee saved registers of the process to fork_current_process,
+// the new process continues with them from where the syscall returns
+__attribute__((naked)) void syscall_fork() {
+    asm volatile("push %rbx\n"
+                 "push %r12\n"
+                 "push %r13\n"
+                 "push %r14\n"
+                 "push %r15\n"
+
+                 "mov %rsp, %rdi\n"
+                 "call fork_current_process\n"
+
+                 "pop %r15\n"
+                 "pop %r14\n"
+                 "pop %r13\n"
+                 "pop %r12\n"
+                 "pop %rbx\n"
+                 "ret");
 }
 
 void prepare_syscalls() {
@@ -136,4 +153,5 @@ void prepare_syscalls() {
     g_syscall_table[SYSCALL_GET_FRAMEBUFFER] = &syscall_get_framebuffer;
     g_syscall_table[SYSCALL_GETCH] = &syscall_getch;
     g_syscall_table[SYSCALL_GET_KEYSTATE] = &syscall_get_keystate;
+    g_syscall_table[SYSCALL_FORK] = &syscall_fork;
 }
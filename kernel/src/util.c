@@ -7,3 +7,10 @@ bool range_contains(uint64_t x, uint64_t lower, uint64_t size) {
 }
 
 bool bound_contains(uint64_t x, uint64_t lower, uint64_t upper) { return x >= lower && x < upper; }
+
+uint64_t read_timestamp_counter() {
+    uint32_t low;
+    uint32_t high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}